@@ -0,0 +1,423 @@
+// lexicalunit (c) 2012
+//
+// This code is released under the Artistic License 2.0.
+// http://opensource.org/licenses/artistic-license-2.0
+
+// Micro-benchmarks for the features that exist to save time or memory, each against the plain alternative.
+//
+// Build optimized, then pass a scale factor to grow every data set:
+//     g++ -O2 -DNDEBUG -pthread bench.cpp -o bench && ./bench [scale]
+// Some sections need build flags and say so when they are skipped: -DDICT_ORDERED_INDEX for range queries,
+// and C++11 for thread scaling.
+// Times are wall clock times under C++11, and processor times otherwise.
+
+#include "dict.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#ifndef BOOST_NO_CXX11_HDR_CHRONO
+#include <chrono>
+#endif // BOOST_NO_CXX11_HDR_CHRONO
+
+namespace
+{
+	// Heap bytes allocated and not yet freed while counting is set, by the operator new and delete below.
+	bool counting = false;
+	std::ptrdiff_t live_bytes = 0;
+
+	// Prefixes each heap block with its size, keeping the rest of the block maximally aligned.
+	union block_header
+	{
+		std::size_t size;
+		long double align;
+		void* pointer;
+	};
+} // namespace
+
+// never inlined, so that compilers don't pair the malloc() and free() inside with the callers' new and delete
+#ifdef BOOST_NO_CXX11_NOEXCEPT
+BOOST_NOINLINE void* operator new(std::size_t size) throw(std::bad_alloc)
+#else
+BOOST_NOINLINE void* operator new(std::size_t size)
+#endif // BOOST_NO_CXX11_NOEXCEPT
+{
+	block_header* header = static_cast<block_header*>(std::malloc(sizeof(block_header) + size));
+	if(!header)
+		throw std::bad_alloc();
+	header->size = size;
+	if(counting)
+		live_bytes += size;
+	return header + 1;
+}
+
+BOOST_NOINLINE void operator delete(void* p) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	if(!p)
+		return;
+	block_header* header = static_cast<block_header*>(p) - 1;
+	if(counting)
+		live_bytes -= header->size;
+	std::free(header);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, std::size_t) BOOST_NOEXCEPT_OR_NOTHROW
+{
+	operator delete(p);
+}
+#endif // __cpp_sized_deallocation
+
+namespace
+{
+	//! Measures the seconds elapsed since its construction.
+	class timer
+	{
+	public:
+		timer()
+		: start(now())
+		{
+
+		}
+
+		double seconds() const
+		{
+			return now() - start;
+		}
+
+	private:
+		static double now()
+		{
+			#ifndef BOOST_NO_CXX11_HDR_CHRONO
+			return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			#else
+			return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+			#endif // BOOST_NO_CXX11_HDR_CHRONO
+		}
+
+		const double start;
+	};
+
+	// Results are accumulated here, so that the optimizer can't drop the work being measured.
+	volatile std::size_t sink = 0;
+
+	void section(const char* title)
+	{
+		std::printf("\n%s\n", title);
+	}
+
+	// Prints the time per operation, and returns it in nanoseconds.
+	double report(const char* what, const double seconds, const std::size_t operations)
+	{
+		const double nanoseconds = seconds * 1e9 / static_cast<double>(operations);
+		std::printf("  %-44s %12.1f ns/op\n", what, nanoseconds);
+		return nanoseconds;
+	}
+
+	std::string numbered(const char* prefix, const std::size_t n)
+	{
+		return prefix + boost::lexical_cast<std::string>(n);
+	}
+
+	// Range queries through the ordered index against a scan of the whole sequence.
+	void bench_ranges(const std::size_t scale)
+	{
+		section("ordered index: prefix_range() and key_range() vs a linear scan");
+		#ifdef DICT_ORDERED_INDEX
+		const std::size_t groups = 100, size = 200000 * scale, queries = 200;
+		dict d;
+		for(std::size_t n = 0; n < size; ++n)
+			d.add(numbered("metric.g", n % groups) + numbered(".", n) + ".value", static_cast<int>(n));
+		std::printf("  %lu keys in %lu groups\n", static_cast<unsigned long>(size), static_cast<unsigned long>(groups));
+
+		timer scan;
+		for(std::size_t q = 0; q < queries; ++q)
+		{
+			const std::string prefix = numbered("metric.g", q % groups) + ".";
+			for(dict::const_iterator i = d.begin(), end = d.end(); i != end; ++i)
+				sink += i->first.compare(0, prefix.size(), prefix) == 0;
+		}
+		const double linear = report("linear scan for a prefix", scan.seconds(), queries);
+
+		timer ranged;
+		for(std::size_t q = 0; q < queries; ++q)
+		{
+			const dict::key_range_type range = d.prefix_range(numbered("metric.g", q % groups) + ".");
+			sink += std::distance(range.first, range.second);
+		}
+		const double prefixed = report("prefix_range()", ranged.seconds(), queries);
+
+		timer bounded;
+		for(std::size_t q = 0; q < queries; ++q)
+		{
+			const dict::key_range_type range = d.key_range(numbered("metric.g", q % groups) + ".1", numbered("metric.g", q % groups) + ".2");
+			sink += std::distance(range.first, range.second);
+		}
+		const double keyed = report("key_range()", bounded.seconds(), queries);
+		std::printf("  prefix_range() is %.0fx and key_range() %.0fx faster than a scan\n", linear / prefixed, linear / keyed);
+		#else
+		(void)scale;
+		std::printf("  skipped: build with -DDICT_ORDERED_INDEX\n");
+		#endif // DICT_ORDERED_INDEX
+	}
+
+	// Memory held by frozen sub-dictionaries, and the latency of their first access, against plain ones.
+	void bench_compression(const std::size_t scale)
+	{
+		section("cold storage: frozen sub-dicts vs plain ones");
+		const std::size_t records = 2000 * scale, fields = 64;
+
+		// records with the same field names and repetitive values, like rows of a table
+		counting = true;
+		live_bytes = 0;
+		dict d;
+		for(std::size_t r = 0; r < records; ++r)
+		{
+			dict record;
+			for(std::size_t f = 0; f < fields; ++f)
+			{
+				if(f % 2)
+					record.add(numbered("field", f), static_cast<int>(r * f % 1000));
+				else
+					record.add(numbered("field", f), numbered("status-", r % 7));
+			}
+			d.add(numbered("record", r), record);
+		}
+		const std::ptrdiff_t plain = live_bytes;
+
+		d.compact(1);
+		timer freezing;
+		sink += d.compact(1);
+		const double frozen_seconds = freezing.seconds();
+		const std::ptrdiff_t compressed = live_bytes;
+		counting = false;
+
+		std::printf("  %lu records of %lu fields: %.1f MB plain, %.1f MB frozen (%.1fx smaller)\n"
+			, static_cast<unsigned long>(records), static_cast<unsigned long>(fields)
+			, plain / 1e6, compressed / 1e6, static_cast<double>(plain) / compressed);
+		report("freeze a record", frozen_seconds, records);
+
+		timer cold;
+		for(std::size_t r = 0; r < records; ++r)
+		{
+			int value = 0;
+			d.get_recursive(numbered("record", r) + "::field1", value);
+			sink += value;
+		}
+		const double inflate = report("first get from a frozen record", cold.seconds(), records);
+
+		timer hot;
+		for(std::size_t r = 0; r < records; ++r)
+		{
+			int value = 0;
+			d.get_recursive(numbered("record", r) + "::field1", value);
+			sink += value;
+		}
+		const double get = report("get from a plain record", hot.seconds(), records);
+		std::printf("  the first access costs %.0fx a plain get\n", inflate / get);
+	}
+
+	// Random lookups in a dictionary much larger than the L2 cache, one at a time and in batches.
+	void bench_batch(const std::size_t scale)
+	{
+		section("batch get vs single gets, on a dict larger than L2");
+		const std::size_t size = (1 << 19) * scale, lookups = 1 << 18, width = 16;
+		dict d;
+		for(std::size_t n = 0; n < size; ++n)
+			d.add(numbered("key", n), static_cast<int>(n));
+		const dict& c = d;
+		std::printf("  %lu keys, about %.0f MB\n", static_cast<unsigned long>(size), size * dict::memory_weight(c.front()) / 1e6);
+
+		std::vector<std::string> keys(lookups);
+		for(std::vector<std::string>::iterator i = keys.begin(), end = keys.end(); i != end; ++i)
+			*i = numbered("key", (static_cast<std::size_t>(std::rand()) * RAND_MAX + std::rand()) % size);
+
+		int values[width];
+		timer single;
+		for(std::size_t n = 0; n < lookups; ++n)
+		{
+			c.get(keys[n], values[n % width]);
+			sink += values[n % width];
+		}
+		const double one = report("get()", single.seconds(), lookups);
+
+		dict::batch b;
+		timer batched;
+		for(std::size_t n = 0; n < lookups; n += width)
+		{
+			b.clear();
+			for(std::size_t k = 0; k < width; ++k)
+				b.add(keys[n + k], values[k]);
+			sink += c.get(b);
+		}
+		const double many = report("get(batch) of 16 keys, per key", batched.seconds(), lookups);
+		std::printf("  batches are %.1fx faster per key\n", one / many);
+	}
+
+	// 64-bit integers stored natively against the lexical_cast round trip through std::string they used to need.
+	void bench_int64(const std::size_t scale)
+	{
+		section("native boost::int64_t vs a lexical_cast round trip through std::string");
+		const std::size_t size = 200000 * scale;
+		std::vector<std::string> keys(size);
+		for(std::size_t n = 0; n < size; ++n)
+			keys[n] = numbered("id", n);
+		const boost::int64_t base = boost::int64_t(1) << 40;
+
+		dict native;
+		timer stored;
+		for(std::size_t n = 0; n < size; ++n)
+			native.add(keys[n], base + static_cast<boost::int64_t>(n));
+		for(std::size_t n = 0; n < size; ++n)
+		{
+			boost::int64_t value = 0;
+			native.get(keys[n], value);
+			sink += static_cast<std::size_t>(value);
+		}
+		const double fast = report("add() and get() a boost::int64_t", stored.seconds(), size);
+
+		dict text;
+		timer cast;
+		for(std::size_t n = 0; n < size; ++n)
+			text.add(keys[n], boost::lexical_cast<std::string>(base + static_cast<boost::int64_t>(n)));
+		for(std::size_t n = 0; n < size; ++n)
+		{
+			std::string value;
+			text.get(keys[n], value);
+			sink += static_cast<std::size_t>(boost::lexical_cast<boost::int64_t>(value));
+		}
+		const double slow = report("the same through lexical_cast", cast.seconds(), size);
+		std::printf("  native storage is %.1fx faster\n", slow / fast);
+	}
+
+	// Bulk updates of a dictionary with disjoint keys: a loop of add(), update() copying, update() relinking the nodes
+	// of a dictionary moved in, and merge(), against a memcpy() of the bytes the values weigh.
+	void bench_update(const std::size_t scale)
+	{
+		section("update() and merge() vs a loop of add(), 100k disjoint keys");
+		const std::size_t size = 100000 * scale, repeats = 5;
+		// values too long for the small string optimization, so that copying them allocates
+		const std::string padding(40, '.');
+		dict source;
+		for(std::size_t n = 0; n < size; ++n)
+			source.add(numbered("source.", n), padding + numbered("value-", n));
+		dict base;
+		for(std::size_t n = 0; n < size; ++n)
+			base.add(numbered("target.", n), padding + numbered("value-", n));
+		std::size_t bytes = 0;
+		for(dict::const_iterator i = source.begin(), end = source.end(); i != end; ++i)
+			bytes += dict::memory_weight(*i);
+		std::printf("  %lu keys, %.1f MB of values\n", static_cast<unsigned long>(size), bytes / 1e6);
+
+		double seconds[5] = { };
+		std::vector<char> from(bytes, 1), to(bytes);
+		for(std::size_t r = 0; r < repeats; ++r)
+		{
+			timer copying;
+			std::memcpy(&to[0], &from[0], bytes);
+			seconds[0] += copying.seconds();
+			sink += to[r];
+
+			dict added(base);
+			timer adding;
+			for(dict::const_iterator i = source.begin(), end = source.end(); i != end; ++i)
+				added.add(i->first, boost::get<std::string>(i->second));
+			seconds[1] += adding.seconds();
+
+			dict updated(base);
+			timer updating;
+			updated.update(source);
+			seconds[2] += updating.seconds();
+
+			dict moved(base), donor(source);
+			timer moving;
+			#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+			moved.update(std::move(donor));
+			#else
+			moved.update(donor);
+			#endif // BOOST_NO_CXX11_RVALUE_REFERENCES
+			seconds[3] += moving.seconds();
+
+			dict merged(base);
+			timer merging;
+			merged.merge(source);
+			seconds[4] += merging.seconds();
+			sink += added.size() + updated.size() + moved.size() + merged.size();
+		}
+		const double copy = report("memcpy() of the same bytes, per key", seconds[0], repeats * size);
+		const double add = report("loop of add()", seconds[1], repeats * size);
+		report("update(const dict&)", seconds[2], repeats * size);
+		#ifdef DICT_NODE_HANDLES
+		const double move = report("update(dict&&), relinking nodes", seconds[3], repeats * size);
+		#else
+		const double move = report("update(dict&&), copying: no node handles", seconds[3], repeats * size);
+		#endif // DICT_NODE_HANDLES
+		report("merge()", seconds[4], repeats * size);
+		std::printf("  update(dict&&) is %.1fx faster than add() and %.1fx slower than memcpy()\n", add / move, move / copy);
+	}
+
+	// The recursive algorithms on a large tree, from 1 to 64 threads.
+	void bench_threads(const std::size_t scale)
+	{
+		section("thread scaling of size_recursive(), str(), copying and ==");
+		#ifdef DICT_PARALLEL
+		const std::size_t size = 16 * DICT_PARALLEL_THRESHOLD * scale, repeats = 3;
+		dict record;
+		for(std::size_t f = 0; f < 8; ++f)
+			record.add(numbered("field", f), numbered("value-", f));
+		dict d;
+		for(std::size_t n = 0; n < size; ++n)
+			d.add(numbered("record", n), record);
+		std::printf("  %lu records, %lu values; %u hardware threads\n", static_cast<unsigned long>(size)
+			, static_cast<unsigned long>(d.size_recursive()), std::thread::hardware_concurrency());
+		std::printf("  %8s %14s %14s %14s %14s %9s\n", "threads", "size (ms)", "str (ms)", "copy (ms)", "== (ms)", "speedup");
+
+		const unsigned threads = dict::parallelism();
+		double serial = 0;
+		for(unsigned n = 1; n <= 64; n *= 2)
+		{
+			dict::parallelism(n);
+			double seconds[4] = { };
+			for(std::size_t r = 0; r < repeats; ++r)
+			{
+				timer counting;
+				sink += d.size_recursive();
+				seconds[0] += counting.seconds();
+				timer printing;
+				sink += d.str().size();
+				seconds[1] += printing.seconds();
+				timer copying;
+				const dict copy(d);
+				seconds[2] += copying.seconds();
+				timer comparing;
+				sink += copy == d;
+				seconds[3] += comparing.seconds();
+			}
+			const double total = seconds[0] + seconds[1] + seconds[2] + seconds[3];
+			if(n == 1)
+				serial = total;
+			std::printf("  %8u %14.2f %14.2f %14.2f %14.2f %8.2fx\n", n, seconds[0] * 1e3 / repeats, seconds[1] * 1e3 / repeats
+				, seconds[2] * 1e3 / repeats, seconds[3] * 1e3 / repeats, serial / total);
+		}
+		dict::parallelism(threads);
+		#else
+		(void)scale;
+		std::printf("  skipped: needs C++11, without -DDICT_NO_PARALLEL\n");
+		#endif // DICT_PARALLEL
+	}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	const std::size_t scale = argc > 1 ? std::max(1ul, std::strtoul(argv[1], 0, 10)) : 1;
+	std::printf("scale %lu\n", static_cast<unsigned long>(scale));
+	bench_ranges(scale);
+	bench_compression(scale);
+	bench_batch(scale);
+	bench_int64(scale);
+	bench_update(scale);
+	bench_threads(scale);
+	return 0;
+}
@@ -6,7 +6,15 @@
 #ifndef LEXICALUNIT_DICT_H
 #define LEXICALUNIT_DICT_H
 
-#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/config.hpp>
+#include <boost/core/ignore_unused.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/iterator/filter_iterator.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/iterator/transform_iterator.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/mpl/deref.hpp>
 #include <boost/mpl/contains.hpp>
@@ -15,25 +23,94 @@
 #include <boost/mpl/if.hpp>
 #include <boost/mpl/not.hpp>
 #include <boost/mpl/or.hpp>
+#include <boost/range/iterator_range.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/hashed_index.hpp>
 #include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
+#include <boost/next_prior.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/swap.hpp>
 #include <boost/type_traits/is_convertible.hpp>
+#include <boost/type_traits/is_enum.hpp>
+#include <boost/type_traits/is_floating_point.hpp>
+#include <boost/type_traits/is_integral.hpp>
 #include <boost/type_traits/is_same.hpp>
+#include <boost/type_traits/is_signed.hpp>
 #include <boost/utility/enable_if.hpp>
 #include <boost/variant.hpp>
+#include <boost/version.hpp>
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
-// todo: find_recursive(), count_recursive(), erase_recursive() methods?
-// todo: find_if(), erase_if()/remove_if() methods? recursive versions too?
+// Recursive algorithms (size_recursive(), str(), comparison and copying) split large dictionaries across threads.
+// Define DICT_NO_PARALLEL to always run them serially.
+#if !defined(DICT_NO_PARALLEL) && !defined(BOOST_NO_CXX11_HDR_THREAD) && !defined(BOOST_NO_CXX11_HDR_MUTEX) \
+	&& !defined(BOOST_NO_CXX11_HDR_CONDITION_VARIABLE) && !defined(BOOST_NO_CXX11_HDR_ATOMIC) \
+	&& !defined(BOOST_NO_CXX11_HDR_FUNCTIONAL) && !defined(BOOST_NO_CXX11_LAMBDAS) \
+	&& !defined(BOOST_NO_CXX11_RVALUE_REFERENCES)
+#define DICT_PARALLEL
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#endif // DICT_PARALLEL
+
+// save_async() and load_async() need C++11 futures.
+#if !defined(BOOST_NO_CXX11_HDR_FUTURE) && !defined(BOOST_NO_CXX11_LAMBDAS) && !defined(BOOST_NO_CXX11_RVALUE_REFERENCES)
+#define DICT_ASYNC
+#include <cstdio>
+#include <future>
+#include <ios>
+#endif // DICT_ASYNC
+
+// Define DICT_ORDERED_INDEX to additionally index keys in sorted order, enabling lower_bound(), upper_bound(),
+// equal_range(), key_range() and prefix_range(). Without it dictionaries carry no ordered index at all.
+// The macro changes the layout of dict, so it must be defined the same way in every translation unit of a program.
+
+// Boost.MultiIndex supports node extraction since Boost 1.74, which lets update() move values between dictionaries
+// by relinking their nodes. Older versions fall back to copying.
+#if BOOST_VERSION >= 107400 && !defined(BOOST_NO_CXX11_RVALUE_REFERENCES)
+#define DICT_NODE_HANDLES
+#endif // BOOST_VERSION
+
+// Hints that memory is about to be read, so that the cache misses of independent lookups overlap.
+#if defined(__GNUC__) || defined(__clang__)
+#define DICT_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define DICT_PREFETCH(address) ((void)0)
+#endif // __GNUC__
+
+// Frozen dictionaries inflate on first access, even through a const reference, so concurrent readers lock them.
+// Without <mutex>, the lock is Boost.Thread's boost::mutex, which is header-only on POSIX but not everywhere.
+#ifndef BOOST_NO_CXX11_HDR_MUTEX
+#include <mutex>
+#else
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#endif // BOOST_NO_CXX11_HDR_MUTEX
+
+// Minimum number of items a single dictionary must hold before its recursive algorithms are parallelized.
+#ifndef DICT_PARALLEL_THRESHOLD
+#define DICT_PARALLEL_THRESHOLD 4096
+#endif // DICT_PARALLEL_THRESHOLD
+
 // todo: rearrange() method?
-// todo: splice(), unique(), sort(), reverse() methods?
+// todo: splice(), unique(), reverse() methods?
 // todo: separate add(), modify(), and replace() methods?
-// todo: key_iterators?: equal_range(), lower_bound(), upper_bound(), etc...
 // todo: better coverage with unit tests
 // todo: c++11: emplace_front(), emplace_back()
 // todo: c++11: emplace(), emplace_hint()
@@ -85,13 +162,73 @@ struct dict_supports;
 template<class>
 struct dict_implicitly_supports;
 
+//! Provides the type that dict stores a value of type T as, if T is implicitly supported.
+template<class T, class Enable = void>
+struct dict_preferred_type;
+
+namespace details
+{
+	// Projections and filters over dictionary values, for the lazy views returned by dict::keys() and friends.
+	template<class Value>
+	struct select_key
+	{
+		typedef const typename Value::first_type& result_type;
+
+		result_type operator()(const Value& value) const
+		{
+			return value.first;
+		}
+	};
+
+	template<class Value>
+	struct select_value
+	{
+		typedef const typename Value::second_type& result_type;
+
+		result_type operator()(const Value& value) const
+		{
+			return value.second;
+		}
+	};
+
+	template<class Value, class T>
+	struct select_as
+	{
+		typedef const T& result_type;
+
+		result_type operator()(const Value& value) const
+		{
+			return boost::get<T>(value.second);
+		}
+	};
+
+	template<class Value, class T>
+	struct holds
+	{
+		bool operator()(const Value& value) const
+		{
+			return boost::get<T>(&value.second) != 0;
+		}
+	};
+
+	#ifndef BOOST_NO_CXX11_HDR_MUTEX
+	typedef std::mutex cold_mutex;
+	typedef std::lock_guard<std::mutex> cold_lock;
+	#else
+	typedef boost::mutex cold_mutex;
+	typedef boost::lock_guard<boost::mutex> cold_lock;
+	#endif // BOOST_NO_CXX11_HDR_MUTEX
+} // namespace details
+
 //! Provides a Python-like dictionary type.
 class dict
 {
 public:
 	typedef std::string key_type; //!< Lookup type for this dictionary.
+	typedef std::vector<unsigned char> bytes_type; //!< Raw binary data.
 	typedef boost::variant<
-		// order matters: preference first
+		// order matters: the binary format identifies types by position, and after integers and floating point
+		// numbers, implicitly supported types are stored as the first type they convert to
 		float
 		, int
 		, std::string
@@ -101,7 +238,10 @@ public:
 		, std::vector<bool>
 		, boost::recursive_wrapper<dict>
 		, boost::recursive_wrapper<std::vector<dict> >
-		// , bool // problematic and unnecessary
+		, double
+		, boost::int64_t
+		, bool
+		, bytes_type
 	> mapped_type; //!< Limited supported types that can be stored in this dictionary.
 	typedef mapped_type::types types; //!< MPL Sequence of supported types.
 	typedef std::pair<key_type, mapped_type> value_type; //!< Value type stored by this dictionary.
@@ -116,47 +256,139 @@ private:
 		, boost::multi_index::indexed_by<
 			boost::multi_index::sequenced<>
 			, boost::multi_index::hashed_unique<boost::multi_index::member<value_type, key_type, &value_type::first> >
+			#ifdef DICT_ORDERED_INDEX
+			, boost::multi_index::ordered_unique<boost::multi_index::member<value_type, key_type, &value_type::first> >
+			#endif // DICT_ORDERED_INDEX
 		>
 	> storage_type;
 	typedef storage_type::nth_index<0>::type sequenced_index_type;
 	typedef storage_type::nth_index<1>::type key_index_type;
+	#ifdef DICT_ORDERED_INDEX
+	typedef storage_type::nth_index<2>::type ordered_index_type;
+	#endif // DICT_ORDERED_INDEX
 
 private:
 	sequenced_index_type& sequenced_index()
 	{
+		wake();
 		return storage.get<0>();
 	}
 
 	const sequenced_index_type& sequenced_index() const
 	{
+		wake();
 		return storage.get<0>();
 	}
 
 	key_index_type& key_index()
 	{
+		wake();
 		return storage.get<1>();
 	}
 
 	const key_index_type& key_index() const
 	{
+		wake();
 		return storage.get<1>();
 	}
 
-	template<class T>
-	typename boost::enable_if<dict_supports<T>, void>::type
-	add_impl(const key_type& key, const T& value, const bool back)
+	#ifdef DICT_ORDERED_INDEX
+	ordered_index_type& ordered_index()
+	{
+		wake();
+		return storage.get<2>();
+	}
+
+	const ordered_index_type& ordered_index() const
+	{
+		wake();
+		return storage.get<2>();
+	}
+	#endif // DICT_ORDERED_INDEX
+
+	// Inflates this dictionary if it is frozen, and marks it as recently used.
+	void wake() const
+	{
+		if(cold)
+			wake_cold();
+	}
+
+	void put(const value_type& value, const bool back)
 	{
-		if(count(key))
+		put(key_index().find(value.first), value, back);
+	}
+
+	// Same as above, given the result of looking up the value's key.
+	void put(const key_index_type::iterator i, const value_type& value, const bool back)
+	{
+		if(i != key_index().end())
 		{
-			key_index().replace(key_index().find(key), value_type(key, value));
+			record(change::replace, value.first);
+			detach(*i);
+			key_index().replace(i, value);
+			attach(*i, false);
+			if(cache)
+				touch(storage.project<0>(i));
 		}
 		else
 		{
-			if(back)
-				storage.push_back(value_type(key, value));
+			// a cache takes new values at the front, as the most recently used
+			record(change::add, value.first);
+			if(back && !cache)
+				attach(*storage.push_back(value).first, true);
 			else
-				storage.push_front(value_type(key, value));
+				attach(*storage.push_front(value).first, false);
+		}
+		if(cache)
+			evict(1);
+	}
+
+	#ifdef DICT_NODE_HANDLES
+	// Same as above, moving the value out of a node extracted from another dictionary and reusing the node if the key is new.
+	// The node is inserted before anything is looked up, so that a new key costs a single probe of the hash index.
+	void put(storage_type::node_type& node)
+	{
+		storage_type::insert_return_type result = storage.insert(cache ? storage.begin() : storage.end(), std::move(node));
+		if(result.inserted)
+		{
+			record(change::add, result.position->first);
+			attach(*result.position, !cache);
 		}
+		else
+		{
+			const key_index_type::iterator i = storage.project<1>(result.position);
+			record(change::replace, i->first);
+			detach(*i);
+			key_index().replace(i, std::move(result.node.value()));
+			attach(*i, false);
+			if(cache)
+				touch(result.position);
+		}
+		if(cache)
+			evict(1);
+	}
+	#endif // DICT_NODE_HANDLES
+
+	// Returns the sub-dictionary stored at key without copying it, or null.
+	const dict* find_dict(const key_type& key) const
+	{
+		const key_index_type::const_iterator i = key_index().find(key);
+		return i == key_index().end() ? 0 : boost::get<dict>(&i->second);
+	}
+
+	template<class T>
+	typename boost::enable_if<boost::mpl::contains<types, T>, void>::type
+	add_impl(const key_type& key, const T& value, const bool back)
+	{
+		put(value_type(key, value), back);
+	}
+
+	// string literals and other types convertible to std::string, which the variant would otherwise store as bool
+	template<class T>
+	typename boost::enable_if<boost::mpl::and_<dict_supports<T>, boost::mpl::not_<boost::mpl::contains<types, T> > >, void>::type
+	add_impl(const key_type& key, const T& value, const bool back)
+	{
+		put(value_type(key, std::string(value)), back);
 	}
 
 	template<class T>
@@ -182,6 +414,44 @@ public:
 	typedef sequenced_index_type::const_iterator const_iterator; //!< Sequential iterator, ordered by insertion.
 	typedef sequenced_index_type::reverse_iterator reverse_iterator; //!< Reverse sequential iterator, ordered by insertion.
 	typedef sequenced_index_type::const_reverse_iterator const_reverse_iterator; //!< Reverse sequential iterator, ordered by insertion.
+	#ifdef DICT_ORDERED_INDEX
+	typedef ordered_index_type::const_iterator key_const_iterator; //!< Sequential iterator, ordered by key.
+	typedef std::pair<key_const_iterator, key_const_iterator> key_range_type; //!< Range of key_const_iterator.
+	#endif // DICT_ORDERED_INDEX
+	class recursive_const_iterator; //!< Depth-first iterator over the values of this dictionary and its sub-dictionaries.
+	class batch; //!< Keys fetched together by get(batch&), each bound to an output variable.
+	typedef boost::iterator_range<const_iterator> items_view; //!< Lazy range of values, in sequence order. See items().
+	typedef boost::iterator_range<boost::transform_iterator<details::select_key<value_type>, const_iterator> > keys_view; //!< Lazy range of keys, in sequence order. See keys().
+	typedef boost::iterator_range<boost::transform_iterator<details::select_value<value_type>, const_iterator> > values_view; //!< Lazy range of mapped values, in sequence order. See values().
+
+	//! Lazy range of the values stored as type T, in sequence order. See items_of().
+	template<class T>
+	struct items_of_view
+	{
+		typedef boost::filter_iterator<details::holds<value_type, T>, const_iterator> iterator;
+		typedef boost::iterator_range<iterator> type;
+	};
+
+	//! Lazy range of the mapped values stored as type T, as const T&, in sequence order. See values_as().
+	template<class T>
+	struct values_as_view
+	{
+		typedef boost::transform_iterator<details::select_as<value_type, T>, typename items_of_view<T>::iterator> iterator;
+		typedef boost::iterator_range<iterator> type;
+	};
+	typedef boost::iterator_range<recursive_const_iterator> recursive_range; //!< Range of recursive_const_iterator.
+
+	//! A mutation recorded by the journal.
+	struct change
+	{
+		//! Kinds of mutation. A reset means the whole dictionary was replaced, by swap() or assignment.
+		//! A reorder means the order of the whole dictionary changed, by sort().
+		enum kind_type { add, replace, erase, relocate, pop_front, pop_back, clear, reset, reorder };
+
+		size_type version; //!< Journal version after this change.
+		kind_type kind; //!< What happened.
+		key_type path; //!< "::" delimited path of the affected value, empty for clear and reset.
+	};
 
 public:
 	//! Adds (or replaces if already existent) the given (key, value) pair to to this dictionary.
@@ -213,10 +483,27 @@ public:
 	template<class T>
 	bool get(const key_type& key, T& value) const;
 
+	//! Same as above, except that in cache mode a hit also marks the value as most recently used.
+	template<class T>
+	bool get(const key_type& key, T& value);
+
 	//! Gets a dict value at the associated key if possible, otherwise returns an empty dict.
 	dict get(const key_type& key) const;
 
+	//! Same as above, except that in cache mode a hit also marks the value as most recently used.
+	dict get(const key_type& key);
+
+	//! Looks up every key of the given batch and stores each value found into the variable bound to it.
+	//! All keys are located before any value is converted, with their hash buckets prefetched, so that
+	//! the cache misses of large dictionaries overlap instead of adding up.
+	//! Returns the number of keys found and converted; batch::found() tells which ones.
+	size_type get(batch& keys) const;
+
+	//! Same as above, except that in cache mode hits are also marked as most recently used.
+	size_type get(batch& keys);
+
 	//! Same as get() but additionally supports recursively descending into sub-dictionaries by delimiting sub-keys with "::".
+	//! Dictionaries inside a std::vector<dict> are addressed by their index, as in "users::0::name".
 	template<class T>
 	bool get_recursive(const key_type& key, T& value) const;
 
@@ -235,12 +522,16 @@ public:
 	//! Erases the first item from this dictionary.
 	void pop_front()
 	{
+		record(change::pop_front, front().first);
+		detach(front());
 		storage.pop_front();
 	}
 
 	//! Erases the last item from this dictionary.
 	void pop_back()
 	{
+		record(change::pop_back, back().first);
+		detach(back());
 		storage.pop_back();
 	}
 
@@ -276,10 +567,7 @@ public:
 	}
 
 	//! Clears all items from this dictionary.
-	void clear()
-	{
-		storage.clear();
-	}
+	void clear();
 
 	//! Returns 1 if key exists in this dictionary, otherwise 0.
 	//! Note that this method will not recursively look into sub-dictionaries.
@@ -292,48 +580,188 @@ public:
 	//! Note recursive counting in sub-dictionaries is not performed.
 	size_type size() const
 	{
-		return storage.size();
+		return cold ? cold_size() : storage.size();
 	}
 
-	//! Same as size() except that it will recursively descend into sub-dictionaries.
+	//! Same as size() except that it will recursively descend into sub-dictionaries and vectors of sub-dictionaries.
+	//! Large dictionaries are counted in parallel.
 	size_type size_recursive() const;
 
 	//! Searches for an value in this dictionary associated with the given key. If the given key isn't found, returns end().
 	//! Note that recursive searching on sub-dictionaries is not performed.
 	iterator find(const key_type &key)
 	{
-		using namespace std;
-		sequenced_index_type& index = sequenced_index();
-		return find_if(index.begin(), index.end()
-			, boost::bind(key_equal(), key, boost::bind(key_extractor(), _1)));
+		return storage.project<0>(key_index().find(key));
 	}
 
 	//! Searches for an value in this dictionary associated with the given key. If the given key isn't found, returns end().
 	//! Note that recursive searching on sub-dictionaries is not performed.
 	const_iterator find(const key_type &key) const
 	{
-		using namespace std;
-		const sequenced_index_type& index = sequenced_index();
-		return find_if(index.begin(), index.end()
-			, boost::bind(key_equal(), key, boost::bind(key_extractor(), _1)));
+		return storage.project<0>(key_index().find(key));
+	}
+
+	//! Returns an iterator to the first value for which pred returns true, or end() if there is none.
+	//! Note that recursive searching on sub-dictionaries is not performed.
+	template<class Predicate>
+	iterator find_if(Predicate pred)
+	{
+		return std::find_if(begin(), end(), pred);
+	}
+
+	//! Returns an iterator to the first value for which pred returns true, or end() if there is none.
+	//! Note that recursive searching on sub-dictionaries is not performed.
+	template<class Predicate>
+	const_iterator find_if(Predicate pred) const
+	{
+		return std::find_if(begin(), end(), pred);
+	}
+
+	//! Returns a lazy range over the keys of this dictionary, in sequence order. Nothing is copied.
+	keys_view keys() const
+	{
+		return keys_view(
+			boost::make_transform_iterator(begin(), details::select_key<value_type>())
+			, boost::make_transform_iterator(end(), details::select_key<value_type>()));
+	}
+
+	//! Returns a lazy range over the mapped values of this dictionary, in sequence order. Nothing is copied.
+	values_view values() const
+	{
+		return values_view(
+			boost::make_transform_iterator(begin(), details::select_value<value_type>())
+			, boost::make_transform_iterator(end(), details::select_value<value_type>()));
+	}
+
+	//! Returns a lazy range over the (key, value) pairs of this dictionary, in sequence order. Nothing is copied.
+	items_view items() const
+	{
+		return items_view(begin(), end());
+	}
+
+	//! Returns a lazy range over the (key, value) pairs of this dictionary whose values are stored as type T,
+	//! which must be one of the supported types. No conversions are performed.
+	template<class T>
+	typename items_of_view<T>::type items_of() const
+	{
+		typedef typename items_of_view<T>::iterator iterator;
+		return typename items_of_view<T>::type(iterator(begin(), end()), iterator(end(), end()));
 	}
 
+	//! Returns a lazy range over the values of this dictionary stored as type T, as const T&.
+	//! Values of other types are skipped rather than converted, so nothing is copied.
+	template<class T>
+	typename values_as_view<T>::type values_as() const
+	{
+		typedef typename values_as_view<T>::iterator iterator;
+		const typename items_of_view<T>::type items = items_of<T>();
+		return typename values_as_view<T>::type(iterator(items.begin()), iterator(items.end()));
+	}
+
+	//! Returns a lazy range over the values in this dictionary and its sub-dictionaries whose paths match the given pattern.
+	//! Patterns are "::" delimited paths where '*' and '?' are wildcards within a sub-key, as in "users::*::score".
+	//! Iterators yield references into this dictionary, and their path() gives the full path of the current value.
+	//! Dictionaries inside a std::vector<dict> are matched by index on the way down, but are not values themselves:
+	//! "users::*::name" finds the names inside them, while "users::*" finds nothing. Use get_recursive("users::0")
+	//! to reach one of them.
+	recursive_range find_recursive(const key_type& pattern) const;
+
+	//! Returns a lazy range over the values in this dictionary and its sub-dictionaries for which pred(path, value) returns true.
+	template<class Predicate>
+	recursive_range find_recursive_if(Predicate pred) const;
+
+	//! Returns the number of values in this dictionary and its sub-dictionaries whose paths match the given pattern.
+	size_type count_recursive(const key_type& pattern) const;
+
+	//! Erases the values in this dictionary and its sub-dictionaries whose paths match the given pattern.
+	//! Sub-dictionaries are modified in place. Returns the number of values erased.
+	//! Like find_recursive(), it never erases the dictionaries of a std::vector<dict> themselves, only values inside them.
+	size_type erase_recursive(const key_type& pattern);
+
+	//! Erases the values in this dictionary for which pred returns true. Returns the number of values erased.
+	//! Note that this method does not recursively descend into sub-dictionaries.
+	template<class Predicate>
+	size_type erase_if(Predicate pred);
+
+	//! Erases the values in this dictionary and its sub-dictionaries for which pred(path, value) returns true.
+	//! Sub-dictionaries are modified in place. Returns the number of values erased.
+	template<class Predicate>
+	size_type erase_recursive_if(Predicate pred);
+
 	//! Inserts the element pointed to by i before position. If position == i, no operation is performed.
 	void relocate(iterator position, iterator i)
 	{
+		record(change::relocate, i->first);
+		hash_state &= ~ordered_hash_valid;
 		sequenced_index().relocate(position, i);
 	}
 
 	//! The range of elements [first, last) is repositioned just before position.
 	void relocate(iterator position, iterator first, iterator last)
 	{
+		for(iterator i = first; i != last; ++i)
+			record(change::relocate, i->first);
+		hash_state &= ~ordered_hash_valid;
 		sequenced_index().relocate(position, first, last);
 	}
 
+	//! Sorts this dictionary's sequence by key.
+	void sort();
+
+	//! Sorts this dictionary's sequence by the given strict weak ordering on values. The sort is stable.
+	template<class Compare>
+	void sort(Compare comp)
+	{
+		record(change::reorder, key_type());
+		hash_state &= ~ordered_hash_valid;
+		sequenced_index().sort(comp);
+	}
+
+	#ifdef DICT_ORDERED_INDEX
+	//! Returns an iterator to the first value, ordered by key, whose key is not less than the given key.
+	key_const_iterator lower_bound(const key_type& key) const
+	{
+		return ordered_index().lower_bound(key);
+	}
+
+	//! Returns an iterator to the first value, ordered by key, whose key is greater than the given key.
+	key_const_iterator upper_bound(const key_type& key) const
+	{
+		return ordered_index().upper_bound(key);
+	}
+
+	//! Returns the range of values, ordered by key, whose key equals the given key.
+	key_range_type equal_range(const key_type& key) const
+	{
+		return ordered_index().equal_range(key);
+	}
+
+	//! Returns the range of values, ordered by key, whose keys are in [first, last). The range is empty if last < first.
+	key_range_type key_range(const key_type& first, const key_type& last) const
+	{
+		return key_range_type(lower_bound(first), lower_bound(std::max(first, last)));
+	}
+
+	//! Returns the range of values, ordered by key, whose keys start with the given prefix.
+	key_range_type prefix_range(const key_type& prefix) const;
+
+	//! Returns an iterator to the value with the smallest key.
+	key_const_iterator key_begin() const
+	{
+		return ordered_index().begin();
+	}
+
+	//! Returns an iterator to one past the value with the largest key.
+	key_const_iterator key_end() const
+	{
+		return ordered_index().end();
+	}
+	#endif // DICT_ORDERED_INDEX
+
 	//! True iff there are no values in this dictionary.
 	bool empty() const
 	{
-		return storage.empty();
+		return !size();
 	}
 
 	//! Returns the maximum number of values that may be stored in this dictionary.
@@ -345,6 +773,8 @@ public:
 	//! Erases the value pointer to by the given iterator from this dictionary.
 	void erase(iterator pos)
 	{
+		record(change::erase, pos->first);
+		detach(*pos);
 		sequenced_index().erase(pos);
 	}
 
@@ -353,18 +783,35 @@ public:
 	//! Note that this method does not recursively descend into sub-dictionaries.
 	size_type erase(const key_type& key)
 	{
-		return key_index().erase(key);
+		key_index_type::iterator i = key_index().find(key);
+		if(i == key_index().end())
+			return 0;
+		record(change::erase, key);
+		detach(*i);
+		key_index().erase(i);
+		return 1;
 	}
 
 	//! Erases a range of values from this dictionary.
 	//! Note that this method does not recursively descend into sub-dictionaries.
 	void erase(iterator first, iterator last)
 	{
+		for(iterator i = first; i != last; ++i)
+		{
+			record(change::erase, i->first);
+			detach(*i);
+		}
 		sequenced_index().erase(first, last);
 	}
 
 	//! Creates an empty dictionary.
 	dict()
+	: cached_hash(0)
+	, cached_unordered_hash(0)
+	, hash_state(0)
+	, log(0)
+	, cache(0)
+	, cold(0)
 	{
 
 	}
@@ -373,15 +820,51 @@ public:
 	template<class InputIterator>
 	dict(InputIterator first, InputIterator last)
 	: storage(first, last)
+	, cached_hash(0)
+	, cached_unordered_hash(0)
+	, hash_state(0)
+	, log(0)
+	, cache(0)
+	, cold(0)
 	{
 
 	}
 
 	//! Creates a copy of the given dictionary.
+	//! Large dictionaries are copied in parallel. The journal, if any, is not copied.
 	dict(const dict& other)
-	: storage(other.storage)
+	: cached_hash(other.cached_hash)
+	, cached_unordered_hash(other.cached_unordered_hash)
+	, hash_state(other.hash_state)
+	, log(0)
+	, cache(copy_cache(other))
+	, cold(copy_cold(other))
 	{
+		// a frozen dictionary is copied in its compressed form
+		if(!cold)
+			copy_storage(other).swap(storage);
+	}
+
+	#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	//! Creates a dictionary by taking the contents of the given dictionary, leaving it empty.
+	dict(dict&& other)
+	: cached_hash(0)
+	, cached_unordered_hash(0)
+	, hash_state(0)
+	, log(0)
+	, cache(0)
+	, cold(0)
+	{
+		swap(other);
+	}
+	#endif // BOOST_NO_CXX11_RVALUE_REFERENCES
 
+	//! Destroys this dictionary and its journal.
+	~dict()
+	{
+		disable_journal();
+		set_capacity(0);
+		release_cold();
 	}
 
 	//! Replaces this dictionary with a copy of the given dictionary.
@@ -391,10 +874,18 @@ public:
 		return *this;
 	}
 
-	//! Swaps this dictionary with another.
+	//! Swaps the contents of this dictionary with another, including cache settings.
+	//! Journals stay with their dictionaries and record a reset.
 	void swap(dict& other) BOOST_NOEXCEPT
 	{
+		record(change::reset, key_type());
+		other.record(change::reset, key_type());
 		boost::swap(storage, other.storage);
+		boost::swap(cached_hash, other.cached_hash);
+		boost::swap(cached_unordered_hash, other.cached_unordered_hash);
+		boost::swap(hash_state, other.hash_state);
+		boost::swap(cache, other.cache);
+		boost::swap(cold, other.cold);
 	}
 
 	//! Returns a sequential iterator to the beginning of the sequence.
@@ -496,11 +987,227 @@ public:
 	//! Returns a std::string representation of this dictionary.
 	std::string str() const;
 
+	//! Returns a structural hash of this dictionary's keys and values that depends on insertion order.
+	//! The hash is computed on the first call, then cached and kept up to date as this dictionary is modified,
+	//! so repeated calls are cheap. Dictionaries that are never hashed pay nothing for it.
+	//! Like the rest of the cache, it must not be computed concurrently from several threads.
+	std::size_t hash() const;
+
+	//! Same as hash() except that the result does not depend on insertion order.
+	std::size_t unordered_hash() const;
+
+	//! Compresses the contents of this dictionary into its binary representation, releasing the uncompressed values.
+	//! The first access of any kind transparently inflates them again. Both hashes are computed before compressing,
+	//! so hash(), unordered_hash(), size() and size_recursive() work without inflating. Const access from several threads at once is safe:
+	//! the first reader inflates the values while the others wait for it.
+	//! If the compressed form was corrupted in memory, that access throws std::runtime_error and the dictionary stays
+	//! frozen.
+	void freeze();
+
+	//! True iff this dictionary is currently compressed by freeze().
+	bool frozen() const;
+
+	//! Freezes cold sub-dictionaries, including those inside vectors, and returns how many were frozen.
+	//! Call it periodically: a sub-dictionary holding at least min_size values (recursively) becomes a candidate
+	//! on one call, and is frozen on a later call unless it was accessed in between. Frozen sub-dictionaries that
+	//! are inflated by an access become candidates again. This dictionary itself is never frozen.
+	size_type compact(size_type min_size = 1024);
+
+	//! Weighs a value against the capacity of a cache. See set_capacity().
+	typedef boost::function<size_type(const_reference)> weigher_type;
+
+	//! Called with each value a cache evicts, just before it is erased. See set_capacity().
+	typedef boost::function<void(const_reference)> evictor_type;
+
+	//! Turns this dictionary into a bounded least-recently-used cache, or back into a plain dictionary if capacity is 0.
+	//! In cache mode the front of the sequence is the most recently used value: add() and non-const get() hits move
+	//! values there in constant time, and values are evicted from the back while the total weight exceeds the capacity.
+	//! By default every value weighs 1; pass memory_weight to bound memory use instead.
+	void set_capacity(size_type capacity, const weigher_type& weigher = weigher_type(), const evictor_type& evictor = evictor_type());
+
+	//! Returns the capacity set by set_capacity(), or 0 if this dictionary is not a cache.
+	size_type capacity() const;
+
+	//! Returns the total weight of the values in this cache, or 0 if this dictionary is not a cache.
+	size_type weight() const;
+
+	//! Returns the approximate number of bytes used by a value, including sub-dictionaries and vectors.
+	static size_type memory_weight(const_reference value);
+
+	//! Starts recording mutations of this dictionary, including in-place changes to its sub-dictionaries,
+	//! into a ring buffer holding the given number of most recent changes.
+	//! While no journal is enabled, mutations only pay for a null pointer check.
+	//! In cache mode, add() and non-const get() of an existing key move it to the front. Such touches are recorded as
+	//! relocate changes only if touches is true, so that by default lookups don't flood the journal; new keys and
+	//! evictions are always recorded.
+	void enable_journal(size_type capacity = 1024, bool touches = false);
+
+	//! Stops recording mutations and discards the journal.
+	void disable_journal();
+
+	//! Returns the version of the most recent recorded change, or 0 if there is no journal.
+	size_type version() const;
+
+	//! Appends the changes recorded after the given version, oldest first, in time proportional to their number.
+	//! Returns false if there is no journal or if some of those changes have already been overwritten.
+	bool changes_since(size_type version, std::vector<change>& changes) const;
+
+	//! Returns the changes that turn dictionary a into dictionary b, for patch() to apply.
+	//! The changes are themselves a dict, with any of the following keys:
+	//! "removed" (std::vector<std::string> of keys), "added" and "modified" (dicts of new values),
+	//! "nested" (dict of changes to sub-dictionaries present in both) and "order" (std::vector<std::string> of b's keys, if reordered).
+	//! Sub-dictionaries whose structural hashes differ are told apart without being compared; those whose hashes match
+	//! are compared with operator== before being skipped, so a hash collision can not hide a change.
+	static dict diff(const dict& a, const dict& b);
+
+	//! Applies changes produced by diff() to this dictionary. Sub-dictionaries are modified in place.
+	void patch(const dict& changes);
+
+	//! Adds (or replaces if already existent) every value of the given dictionary, like Python's dict.update().
+	//! Replaced values keep their position and new values are appended in the other dictionary's order.
+	void update(const dict& other);
+
+	#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	//! Same as above, except that values are moved out of the given dictionary, leaving it empty.
+	//! New keys reuse the other dictionary's nodes, so nothing is copied or reallocated.
+	void update(dict&& other);
+	#endif // BOOST_NO_CXX11_RVALUE_REFERENCES
+
+	//! How merge() resolves a key present in both dictionaries whose values are not both sub-dictionaries.
+	enum merge_policy { merge_keep, merge_overwrite };
+
+	//! Resolves a merge() conflict given the "::" delimited path of the key, this dictionary's value and the other's.
+	//! Returns the value to keep.
+	typedef boost::function<mapped_type(const key_type&, const mapped_type&, const mapped_type&)> merge_resolver;
+
+	//! Same as update() except that sub-dictionaries present in both dictionaries are merged recursively, in place.
+	//! Other conflicts, including vectors of sub-dictionaries, are resolved by the given policy.
+	void merge(const dict& other, merge_policy policy = merge_overwrite);
+
+	//! Same as above, except that conflicts are resolved by calling the given function.
+	void merge(const dict& other, const merge_resolver& resolve);
+
+	//! Writes a compact binary representation of this dictionary to the given stream.
+	//! Numbers are stored in the host's byte order.
+	void save(std::ostream& out) const;
+
+	//! Replaces the contents of this dictionary with a binary representation written by save().
+	//! Returns true on success; on failure this dictionary is left unchanged.
+	//! The journal and cache mode are kept, and in cache mode loaded values beyond the capacity are evicted.
+	bool load(std::istream& in);
+
+	#ifdef DICT_ASYNC
+	//! Writes the binary representation of the given dictionary to a file on a background thread.
+	//! Serialization overlaps with writing: full chunks are written by another thread while the next ones are filled.
+	//! The future yields true on success.
+	//! Passing a dictionary that keeps changing copies it on the calling thread, in parallel if it is large. That blocks
+	//! for as long as the copy takes and needs as much memory again: there is no copy-on-write storage to make the
+	//! snapshot cheaper. Only frozen dictionaries and sub-dictionaries are cheap to snapshot: they are copied in their
+	//! compressed form and written from it without being inflated, so freeze() or compact() the parts that rarely
+	//! change. std::move() a dictionary that is no longer needed instead, or use the overload below.
+	static std::future<bool> save_async(dict snapshot, const std::string& path);
+
+	//! Same as above, without copying anything: the background thread shares ownership of the dictionary. This suits
+	//! programs that publish immutable versions of a dictionary to their readers and replace the pointer on updates.
+	static std::future<bool> save_async(const boost::shared_ptr<const dict>& snapshot, const std::string& path);
+
+	//! Reads a file written by save() or save_async() on a background thread, reading ahead of the parser.
+	//! The future yields the dictionary, or throws std::ios_base::failure if the file can not be read.
+	static std::future<dict> load_async(const std::string& path);
+	#endif // DICT_ASYNC
+
+	//! Returns the maximum number of threads used by recursive algorithms on large dictionaries.
+	static unsigned parallelism();
+
+	//! Sets the maximum number of threads used by recursive algorithms on large dictionaries.
+	//! A value of 1 disables parallelism. The threads are started on first use and kept in a pool shared by every
+	//! dictionary until the program exits; lowering the limit leaves the extra ones asleep. Nested dictionaries share
+	//! the pool: a large sub-dictionary is split among the threads the rest of the work leaves idle. Only dictionaries
+	//! holding at least DICT_PARALLEL_THRESHOLD values are split, so a tree made of many small dictionaries is
+	//! processed serially.
+	static void parallelism(unsigned n);
+
 	friend bool operator==(const dict& lhs, const dict& rhs);
 	friend bool operator<(const dict& lhs, const dict& rhs);
+	friend class shared_dict; // stores values in the binary format
+
+private:
+	static storage_type copy_storage(const dict& other);
+	struct cache_policy;
+	static cache_policy* copy_cache(const dict& other);
+	struct cold_storage;
+	static cold_storage* copy_cold(const dict& other);
+
+	// Updates the cached hashes and cache weight for a value about to be removed.
+	void detach(const value_type& value);
+
+	// Updates the cached hashes and cache weight for a value just inserted, at the back or elsewhere.
+	void attach(const value_type& value, const bool back);
+
+	template<class Matcher>
+	size_type erase_recursive_impl(const Matcher& matcher, key_type& path, const std::size_t depth);
+
+	template<class Matcher>
+	struct erase_recursive_modifier;
+
+	struct patch_modifier;
+
+	void merge_impl(const dict& other, const merge_policy policy, const merge_resolver& resolve, key_type& path);
+
+	struct merge_modifier;
+
+	struct binary_io;
+
+	struct compact_modifier;
+
+	void wake_cold() const;
+	bool frozen_binary(std::string& raw) const;
+	void release_cold();
+	size_type cold_size() const;
+
+	// Freezes this dictionary if it was not used since the last call, otherwise compacts its sub-dictionaries.
+	// Adds the number of dictionaries frozen to count and returns size_recursive(), computed bottom-up along the way.
+	size_type compact_sub(const size_type min_size, size_type& count);
+	size_type compact_impl(const size_type min_size, size_type& count);
+
+	class journal;
+	struct journal_link;
+	struct journal_scope;
+
+	void record(const change::kind_type kind, const key_type& key)
+	{
+		if(log)
+			log_change(kind, key);
+	}
+
+	// Moves a value of a cache to the front as the most recently used. The move is only journaled on request.
+	void touch(const iterator i);
+
+	void log_change(const change::kind_type kind, const key_type& key);
+
+	// Returns the weight of a value in cache mode, otherwise 0.
+	size_type weigh(const value_type& value) const;
+
+	// Evicts least recently used values while over capacity, keeping at least the given number of values.
+	void evict(const size_type keep);
+
+	// Recomputes the cache weight of all values, then evicts down to the capacity.
+	void reweigh();
+
+	enum
+	{
+		ordered_hash_valid = 1
+		, unordered_hash_valid = 2
+	};
 
 private:
-	storage_type storage;
+	mutable storage_type storage; // inflated on access while frozen
+	mutable std::size_t cached_hash;
+	mutable std::size_t cached_unordered_hash;
+	mutable unsigned char hash_state;
+	journal_link* log;
+	cache_policy* cache;
+	cold_storage* cold;
 };
 
 template<class T>
@@ -510,11 +1217,45 @@ struct dict_supports
 	, boost::is_convertible<T, std::string> > // support string literals
 { };
 
+//! Integers and enumerations are stored as int if they fit in one, otherwise as boost::int64_t.
+//! Unsigned 64-bit values above the range of boost::int64_t keep their bits but wrap around: str() shows them as
+//! negative, while get() into an unsigned 64-bit integer returns the original value.
+template<class T>
+struct dict_preferred_type<T, typename boost::enable_if<boost::mpl::or_<boost::is_integral<T>, boost::is_enum<T> > >::type>
+: boost::mpl::if_c<
+	sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && boost::mpl::or_<boost::is_enum<T>, boost::is_signed<T> >::value)
+	, int
+	, boost::int64_t>
+{ };
+
+//! Floating point numbers are stored as double.
+template<class T>
+struct dict_preferred_type<T, typename boost::enable_if<boost::is_floating_point<T> >::type>
+{
+	typedef double type;
+};
+
+//! Anything else is stored as the first type in dict::types to which it is convertible.
+template<class T, class Enable>
+struct dict_preferred_type
+: find_convertible<dict::types, T>
+{ };
+
+namespace details
+{
+	// Pointers, wide string literals and types with a safe-bool conversion only convert to bool.
+	template<class T>
+	struct converts_only_to_bool
+	: boost::is_same<typename dict_preferred_type<T>::type, bool>
+	{ };
+} // namespace details
+
 template<class T>
 struct dict_implicitly_supports
 : boost::mpl::and_<
 	boost::mpl::not_<dict_supports<T> >
-	, has_convertible<dict::types, T> > // better compile error
+	, has_convertible<dict::types, T> // better compile error
+	, boost::mpl::not_<details::converts_only_to_bool<T> > > // bool must be stored explicitly
 { };
 
 namespace std
@@ -525,8 +1266,29 @@ namespace std
 	{
 		lhs.swap(rhs);
 	}
+
+	#ifndef BOOST_NO_CXX11_HDR_FUNCTIONAL
+	//! specializes std::hash so that dictionaries can be used as keys in unordered containers.
+	//! The first call on a dictionary fills its hash cache, even through a const reference, so hashing one dictionary
+	//! from several threads at once is a data race. Keys stored in a container were hashed on insertion and are safe
+	//! to look up concurrently; call hash() on any other dictionary before sharing it between threads.
+	template<>
+	struct hash<dict>
+	{
+		std::size_t operator()(const dict& d) const
+		{
+			return d.hash();
+		}
+	};
+	#endif // BOOST_NO_CXX11_HDR_FUNCTIONAL
 } // namespace std
 
+//! Supports boost::hash and Boost.Unordered containers. Like std::hash<dict>, it fills the hash cache on first use.
+inline std::size_t hash_value(const dict& d)
+{
+	return d.hash();
+}
+
 namespace details
 {
 	template<class U, class T>
@@ -582,6 +1344,28 @@ namespace details
 			return true;
 		}
 
+		bool operator()(const dict::bytes_type& value) const
+		{
+			// like Python's bytes: b'text\x00'
+			static const char digits[] = "0123456789abcdef";
+			rvalue += "b'";
+			for(dict::bytes_type::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+			{
+				if(*i >= 0x20 && *i < 0x7f && *i != '\'' && *i != '\\')
+				{
+					rvalue += static_cast<char>(*i);
+				}
+				else
+				{
+					rvalue += "\\x";
+					rvalue += digits[*i >> 4];
+					rvalue += digits[*i & 0xf];
+				}
+			}
+			rvalue += "'";
+			return true;
+		}
+
 		template<class U>
 		typename boost::enable_if<is_vector<U>, bool>::type
 		operator()(const U& value) const
@@ -617,104 +1401,2425 @@ namespace details
 			count += 1 + value.size_recursive();
 		}
 
+		void operator()(const std::vector<dict>& value) const
+		{
+			++count;
+			for(std::vector<dict>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				count += i->size_recursive();
+		}
+
 	private:
 		dict::size_type& count;
 	};
-} // namespace details
-
-inline std::ostream& operator<<(std::ostream& o, const dict& d)
-{
-	o << d.str();
-	return o;
-}
-
-template<class T>
-inline typename boost::enable_if<dict_implicitly_supports<T>, void>::type
-dict::add_impl(const dict::key_type& key, const T& value, const bool back)
-{
-	add_impl(key, details::implicit_cast<typename find_convertible<types, T>::type>(value), back);
-}
 
-inline std::string dict::str() const
-{
-	std::string rvalue = "{";
-	for(const_iterator i = this->begin(), end = this->end(); i != end; ++i)
+	template<class InputIterator>
+	dict::size_type size_recursive(InputIterator first, InputIterator last)
 	{
-		std::string temp;
-		boost::apply_visitor(details::get_visitor<std::string>(temp), i->second);
-		rvalue += "'" +  i->first + "': " + temp;
-		if(std::distance(i, end) != 1)
-			rvalue += ", ";
+		dict::size_type count = 0;
+		for(; first != last; ++first)
+			boost::apply_visitor(size_visitor(count), first->second);
+		return count;
 	}
-	rvalue += "}";
-	return rvalue;
-}
-
-template<class T>
-inline bool dict::get(const key_type& key, T& value) const
-{
-	const key_index_type& index = key_index();
-	if(!index.count(key)) return false;
-	return boost::apply_visitor(details::get_visitor<T>(value), index.find(key)->second);
-}
-
-inline dict dict::get(const key_type& key) const
-{
-	dict rvalue;
-	get(key, rvalue);
-	return rvalue;
-}
 
-template<class T>
-inline std::pair<dict::iterator, bool> dict::insert(const std::pair<key_type, T>& value)
-{
-	iterator i = find(value.first);
-	if(i == end())
-		return std::make_pair(i, false);
-	const bool rvalue = add(value.first, value.second);
-	return std::make_pair(find(value.first), rvalue);
-}
+	template<class InputIterator>
+	void append_str(InputIterator first, InputIterator last, std::string& rvalue)
+	{
+		for(InputIterator i = first; i != last; ++i)
+		{
+			if(i != first)
+				rvalue += ", ";
+			rvalue += "'" + i->first + "': ";
+			boost::apply_visitor(get_visitor<std::string>(rvalue), i->second);
+		}
+	}
 
-template<class T>
-inline bool dict::get_recursive(const key_type& key, T& value) const
-{
-	// todo: can this be done more cleanly?
-	std::vector<std::string> keys;
-	std::string::size_type pos = key.find("::");
-	std::string::size_type offset = 0;
-	while(pos != std::string::npos)
+	// Splits a "::" delimited path into its sub-keys.
+	inline void split_path(const std::string& path, std::vector<std::string>& keys)
 	{
-		keys.push_back(key.substr(offset, pos));
-		offset += pos;
-		pos = key.find("::", offset);
-		offset += 2;
+		std::string::size_type offset = 0;
+		for(std::string::size_type pos; (pos = path.find("::", offset)) != std::string::npos; offset = pos + 2)
+			keys.push_back(path.substr(offset, pos - offset));
+		keys.push_back(path.substr(offset));
 	}
-	if(keys.empty())
-		return get(key, value);
 
-	std::vector<std::string>::const_iterator i = keys.begin();
-	dict temp;
-	if(!get(*i++, temp))
-		return false;
+	// Matches s against a pattern where '*' matches any run of characters and '?' matches any single character.
+	inline bool glob_match(const std::string& pattern, const std::string& s)
+	{
+		std::string::size_type p = 0, i = 0, star = std::string::npos, resume = 0;
+		while(i < s.size())
+		{
+			if(p < pattern.size() && (pattern[p] == '?' || pattern[p] == s[i]))
+			{
+				++p;
+				++i;
+			}
+			else if(p < pattern.size() && pattern[p] == '*')
+			{
+				star = p++;
+				resume = i;
+			}
+			else if(star != std::string::npos)
+			{
+				p = star + 1;
+				i = ++resume;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		while(p < pattern.size() && pattern[p] == '*')
+			++p;
+		return p == pattern.size();
+	}
+
+	// Parses a std::vector<dict> index out of a sub-key.
+	inline bool parse_index(const std::string& s, std::size_t& index)
+	{
+		if(s.empty() || s.size() > 18)
+			return false;
+		index = 0;
+		for(std::string::const_iterator i = s.begin(), end = s.end(); i != end; ++i)
+		{
+			if(*i < '0' || *i > '9')
+				return false;
+			index = index * 10 + (*i - '0');
+		}
+		return true;
+	}
+
+	// A "::" delimited pattern split into sub-keys, each of which may contain wildcards.
+	class path_pattern
+	{
+	public:
+		explicit path_pattern(const std::string& pattern)
+		{
+			split_path(pattern, keys);
+			for(std::vector<std::string>::const_iterator i = keys.begin(), end = keys.end(); i != end; ++i)
+				literal.push_back(i->find_first_of("*?") == std::string::npos);
+		}
+
+		std::size_t size() const
+		{
+			return keys.size();
+		}
+
+		// Returns the sub-key at the given depth if it has no wildcards, otherwise null.
+		const std::string* literal_key(const std::size_t depth) const
+		{
+			return depth < keys.size() && literal[depth] ? &keys[depth] : 0;
+		}
+
+		bool match(const std::size_t depth, const std::string& key) const
+		{
+			if(depth >= keys.size())
+				return false;
+			return literal[depth] ? keys[depth] == key : glob_match(keys[depth], key);
+		}
+
+		// erase_recursive_impl() matcher interface
+		bool erase(const std::string&, const dict::value_type& value, const std::size_t depth) const
+		{
+			return depth + 1 == keys.size() && match(depth, value.first);
+		}
+
+		bool descend(const std::string& key, const std::size_t depth) const
+		{
+			return depth + 1 < keys.size() && match(depth, key);
+		}
+
+	private:
+		std::vector<std::string> keys;
+		std::vector<char> literal;
+	};
+
+	template<class Predicate>
+	class path_predicate
+	{
+	public:
+		explicit path_predicate(Predicate pred) : pred(pred) { }
+
+		const std::string* literal_key(const std::size_t) const
+		{
+			return 0;
+		}
+
+		// erase_recursive_impl() matcher interface
+		bool erase(const std::string& path, const dict::value_type& value, const std::size_t) const
+		{
+			return pred(path, value);
+		}
+
+		bool descend(const std::string&, const std::size_t) const
+		{
+			return true;
+		}
+
+	private:
+		mutable Predicate pred;
+	};
+
+	// A small LZ77 block codec in the style of LZ4. The input is encoded as sequences of a token byte
+	// (literal run length and match length - 4, a nibble each, extended by following bytes when 15),
+	// the literals, then a 2 byte offset back to the match. The last sequence has literals only.
+	inline void write_lz_length(std::vector<char>& out, std::size_t n)
+	{
+		for(; n >= 255; n -= 255)
+			out.push_back(static_cast<char>(255));
+		out.push_back(static_cast<char>(n));
+	}
+
+	inline void write_lz_sequence(std::vector<char>& out, const char* literals, const std::size_t literal_length, const std::size_t offset, const std::size_t match_length)
+	{
+		const std::size_t extra = match_length ? match_length - 4 : 0;
+		out.push_back(static_cast<char>((std::min<std::size_t>(literal_length, 15) << 4) | std::min<std::size_t>(extra, 15)));
+		if(literal_length >= 15)
+			write_lz_length(out, literal_length - 15);
+		out.insert(out.end(), literals, literals + literal_length);
+		if(!match_length)
+			return;
+		out.push_back(static_cast<char>(offset & 0xff));
+		out.push_back(static_cast<char>(offset >> 8));
+		if(extra >= 15)
+			write_lz_length(out, extra - 15);
+	}
+
+	inline void lz_compress(const char* data, const std::size_t size, std::vector<char>& out)
+	{
+		const int hash_bits = 14;
+		std::vector<std::size_t> table(std::size_t(1) << hash_bits, 0); // position + 1 of the last occurrence
+		std::size_t anchor = 0, i = 0;
+		while(i + 4 <= size)
+		{
+			boost::uint32_t sequence;
+			std::memcpy(&sequence, data + i, sizeof(sequence));
+			const std::size_t h = static_cast<boost::uint32_t>(sequence * 2654435761u) >> (32 - hash_bits);
+			const std::size_t candidate = table[h];
+			table[h] = i + 1;
+			if(!candidate || i - (candidate - 1) > 0xffff || std::memcmp(data + candidate - 1, data + i, 4))
+			{
+				++i;
+				continue;
+			}
+			const std::size_t match = candidate - 1;
+			std::size_t length = 4;
+			while(i + length < size && data[match + length] == data[i + length])
+				++length;
+			write_lz_sequence(out, data + anchor, i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		}
+		write_lz_sequence(out, data + anchor, size - anchor, 0, 0);
+	}
+
+	inline bool read_lz_length(const char*& in, const char* end, std::size_t& n)
+	{
+		for(unsigned char c = 255; c == 255; n += c)
+		{
+			if(in == end)
+				return false;
+			c = static_cast<unsigned char>(*in++);
+		}
+		return true;
+	}
+
+	// Returns false if the input is corrupt or does not decode to exactly size bytes.
+	inline bool lz_decompress(const std::vector<char>& compressed, const std::size_t size, std::string& out)
+	{
+		out.clear();
+		out.reserve(size);
+		const char* in = compressed.empty() ? 0 : &compressed[0];
+		const char* end = in + compressed.size();
+		while(in != end)
+		{
+			const unsigned char token = static_cast<unsigned char>(*in++);
+			std::size_t literal_length = token >> 4;
+			if(literal_length == 15 && !read_lz_length(in, end, literal_length))
+				return false;
+			if(literal_length > std::size_t(end - in) || out.size() + literal_length > size)
+				return false;
+			out.append(in, literal_length);
+			in += literal_length;
+			if(in == end)
+				break;
+
+			if(end - in < 2)
+				return false;
+			const std::size_t offset = static_cast<unsigned char>(in[0]) | (static_cast<unsigned char>(in[1]) << 8);
+			in += 2;
+			std::size_t match_length = token & 0xf;
+			if(match_length == 15 && !read_lz_length(in, end, match_length))
+				return false;
+			match_length += 4;
+			if(!offset || offset > out.size() || out.size() + match_length > size)
+				return false;
+			for(std::size_t from = out.size() - offset; match_length; --match_length)
+				out.push_back(out[from++]); // may overlap what it is appending
+		}
+		return out.size() == size;
+	}
+
+	struct key_less
+	{
+		bool operator()(const dict::value_type& lhs, const dict::value_type& rhs) const
+		{
+			return lhs.first < rhs.first;
+		}
+	};
+
+	inline std::size_t mix_hash(std::size_t h)
+	{
+		// spreads bits so that sums of item hashes make a reasonable order-insensitive hash
+		h ^= h >> 16;
+		h *= 0x45d9f3b;
+		h ^= h >> 16;
+		return h;
+	}
+
+	class hash_visitor : public boost::static_visitor<std::size_t>
+	{
+	public:
+		explicit hash_visitor(const bool ordered) : ordered(ordered) { }
+
+		template<class T>
+		std::size_t operator()(const T& value) const
+		{
+			return boost::hash<T>()(value);
+		}
+
+		std::size_t operator()(const dict& value) const
+		{
+			return ordered ? value.hash() : value.unordered_hash();
+		}
+
+		std::size_t operator()(const std::vector<dict>& value) const
+		{
+			std::size_t seed = value.size();
+			for(std::vector<dict>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				boost::hash_combine(seed, (*this)(*i));
+			return seed;
+		}
+
+	private:
+		bool ordered;
+	};
+
+	inline std::size_t item_hash(const dict::value_type& value, const bool ordered)
+	{
+		std::size_t seed = boost::hash<dict::key_type>()(value.first);
+		boost::hash_combine(seed, value.second.which());
+		boost::hash_combine(seed, boost::apply_visitor(hash_visitor(ordered), value.second));
+		return seed;
+	}
+
+	#ifdef DICT_PARALLEL
+	inline std::atomic<unsigned>& parallelism()
+	{
+		static std::atomic<unsigned> n(std::max(1u, std::thread::hardware_concurrency()));
+		return n;
+	}
+
+	// Splits n items into several chunks per thread, so that threads finishing early take over the remaining chunks
+	// instead of waiting on one that holds a large sub-dictionary.
+	inline std::size_t parallel_chunks(std::size_t n)
+	{
+		if(n < DICT_PARALLEL_THRESHOLD || parallelism() < 2)
+			return 1;
+		return std::min<std::size_t>(4 * parallelism(), n);
+	}
+
+	// Returns the chunks + 1 boundaries splitting the n items starting at first into evenly sized chunks.
+	template<class Iterator>
+	std::vector<Iterator> partition(Iterator first, std::size_t n, std::size_t chunks)
+	{
+		std::vector<Iterator> bounds(1, first);
+		for(std::size_t c = 0; c < chunks; ++c)
+		{
+			std::advance(first, n / chunks + (c < n % chunks ? 1 : 0));
+			bounds.push_back(first);
+		}
+		return bounds;
+	}
+
+	// The worker threads shared by every parallel algorithm, started on first use and kept until the program exits.
+	// Each parallel_apply() publishes a job whose chunks are taken in turn by its calling thread, by idle workers and
+	// by threads waiting on a job of their own, which run other chunks instead of blocking. Nested dictionaries are
+	// split into jobs too, so they spread over whichever threads are free, while at most parallelism() - 1 workers
+	// run besides the threads that called in.
+	class thread_pool
+	{
+	public:
+		static thread_pool& instance()
+		{
+			static thread_pool pool;
+			return pool;
+		}
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for(std::size_t t = 0; t < workers.size(); ++t)
+				workers[t].join();
+		}
+
+		// Calls fn(c) for each c in [0, chunks) and returns once every call has returned. fn must not throw.
+		void run(const std::size_t chunks, const std::function<void(std::size_t)>& fn)
+		{
+			job j(chunks, fn);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.push_back(&j);
+				start(parallelism() - 1);
+			}
+			wake.notify_all();
+
+			for(std::size_t c; (c = j.next++) < chunks; )
+				execute(j, c);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			const std::deque<job*>::iterator position = std::find(jobs.begin(), jobs.end(), &j);
+			if(position != jobs.end())
+				jobs.erase(position);
+			while(j.done < chunks)
+			{
+				// help with other jobs, such as the sub-dictionaries of our own chunks, while the last ones finish
+				std::size_t c;
+				if(job* other = claim(true, c))
+				{
+					lock.unlock();
+					execute(*other, c);
+					lock.lock();
+				}
+				else
+					wake.wait(lock);
+			}
+		}
+
+	private:
+		struct job
+		{
+			job(const std::size_t chunks, const std::function<void(std::size_t)>& fn) : chunks(chunks), fn(fn), next(0), done(0) {}
+
+			const std::size_t chunks;
+			const std::function<void(std::size_t)>& fn;
+			std::atomic<std::size_t> next;
+			std::atomic<std::size_t> done;
+		};
+
+		thread_pool() : stopping(false) {}
+
+		// Starts workers until there are the given number of them. Called with the mutex held.
+		void start(const std::size_t n)
+		{
+			try
+			{
+				while(workers.size() < n)
+					workers.push_back(std::thread(&thread_pool::work, this, static_cast<unsigned>(workers.size())));
+			}
+			catch(const std::system_error&)
+			{
+				// out of threads: make do with those already running
+			}
+		}
+
+		// Takes the next chunk of the newest job, or of the oldest one, which has the largest chunks, dropping the
+		// jobs that have none left. Called with the mutex held, which keeps a job alive while it is in the queue.
+		job* claim(const bool newest, std::size_t& c)
+		{
+			while(!jobs.empty())
+			{
+				job* j = newest ? jobs.back() : jobs.front();
+				if((c = j->next++) < j->chunks)
+					return j;
+				if(newest)
+					jobs.pop_back();
+				else
+					jobs.pop_front();
+			}
+			return 0;
+		}
+
+		void execute(job& j, const std::size_t c)
+		{
+			// the job may be gone as soon as its last chunk is counted as done
+			const std::size_t chunks = j.chunks;
+			j.fn(c);
+			if(++j.done == chunks)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				wake.notify_all();
+			}
+		}
+
+		void work(const unsigned index)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(!stopping)
+			{
+				// workers beyond a lowered parallelism() stay asleep
+				std::size_t c;
+				job* j = index + 1 < parallelism() ? claim(false, c) : 0;
+				if(j)
+				{
+					lock.unlock();
+					execute(*j, c);
+					lock.lock();
+				}
+				else
+					wake.wait(lock);
+			}
+		}
+
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::deque<job*> jobs;
+		std::vector<std::thread> workers;
+		bool stopping;
+	};
+
+	// Calls fn(c) for each c in [0, chunks) on the thread pool, returning the results in order.
+	// Rethrows the exception of the first chunk that threw one, once every chunk is done.
+	template<class Function>
+	std::vector<decltype(std::declval<Function>()(std::size_t()))> parallel_apply(std::size_t chunks, Function fn)
+	{
+		typedef decltype(fn(std::size_t())) result_type;
+		std::vector<result_type> results(chunks);
+		std::vector<std::exception_ptr> errors(chunks);
+		thread_pool::instance().run(chunks, [&](std::size_t c)
+		{
+			try
+			{
+				results[c] = fn(c);
+			}
+			catch(...)
+			{
+				errors[c] = std::current_exception();
+			}
+		});
+
+		for(std::size_t c = 0; c < chunks; ++c)
+			if(errors[c])
+				std::rethrow_exception(errors[c]);
+		return results;
+	}
+	#endif // DICT_PARALLEL
+} // namespace details
+
+//! A list of keys to fetch from a dictionary at once, each bound to a variable that receives its value.
+//! Keys are hashed as they are added, so a batch built once can be resolved against many dictionaries.
+class dict::batch
+{
+public:
+	//! Adds a key whose value will be stored into the given variable, converted to T as get() does.
+	//! The variable must outlive the batch. Returns this batch, so that calls can be chained.
+	template<class T>
+	batch& add(const key_type& key, T& value)
+	{
+		const slot s = { key, hasher()(key), &value, &assign<T>, false };
+		slots.push_back(s);
+		return *this;
+	}
+
+	//! Returns the number of keys in this batch.
+	size_type size() const
+	{
+		return slots.size();
+	}
+
+	//! True iff the nth key was found and converted by the last get().
+	bool found(const size_type n) const
+	{
+		return slots[n].found;
+	}
+
+	//! Removes all keys from this batch.
+	void clear()
+	{
+		slots.clear();
+	}
+
+private:
+	friend class dict;
+
+	struct slot
+	{
+		key_type key;
+		std::size_t hash;
+		void* value;
+		bool (*assign)(const mapped_type&, void*);
+		bool found;
+	};
+
+	template<class T>
+	static bool assign(const mapped_type& from, void* to)
+	{
+		return boost::apply_visitor(details::get_visitor<T>(*static_cast<T*>(to)), from);
+	}
+
+	// Lets the key index find a slot by its precomputed hash.
+	struct slot_hash
+	{
+		std::size_t operator()(const slot& s) const
+		{
+			return s.hash;
+		}
+	};
+
+	struct slot_equal
+	{
+		bool operator()(const slot& s, const key_type& key) const
+		{
+			return s.key == key;
+		}
+
+		bool operator()(const key_type& key, const slot& s) const
+		{
+			return key == s.key;
+		}
+	};
+
+	std::vector<slot> slots;
+	std::vector<const value_type*> hits; // reused between calls
+};
+
+// Ring buffer of the most recent changes to a dictionary.
+class dict::journal
+{
+public:
+	journal(const size_type capacity, const bool touches)
+	: entries(std::max<size_type>(capacity, 1))
+	, version(0)
+	, touches(touches)
+	{
+
+	}
+
+	void record(const change::kind_type kind, const key_type& prefix, const key_type& key)
+	{
+		change& entry = entries[++version % entries.size()];
+		entry.version = version;
+		entry.kind = kind;
+		entry.path = prefix;
+		entry.path += key;
+	}
+
+	bool since(const size_type from, std::vector<change>& changes) const
+	{
+		if(from > version || version - from > entries.size())
+			return false;
+		for(size_type v = from + 1; v <= version; ++v)
+			changes.push_back(entries[v % entries.size()]);
+		return true;
+	}
+
+	std::vector<change> entries;
+	size_type version;
+	const bool touches;
+};
+
+// The journal a dictionary records into, along with the path from the journal's owner to that dictionary.
+// Sub-dictionaries borrow a link while they are modified in place.
+struct dict::journal_link
+{
+	journal* entries;
+	key_type prefix;
+};
+
+struct dict::journal_scope
+{
+	journal_scope(dict& d, journal_link* link)
+	: d(d)
+	{
+		d.log = link;
+	}
+
+	~journal_scope()
+	{
+		d.log = 0;
+	}
+
+	dict& d;
+};
+
+inline void dict::enable_journal(const size_type capacity, const bool touches)
+{
+	disable_journal();
+	log = new journal_link;
+	log->entries = new journal(capacity, touches);
+}
+
+inline void dict::disable_journal()
+{
+	if(log)
+	{
+		delete log->entries;
+		delete log;
+		log = 0;
+	}
+}
+
+inline dict::size_type dict::version() const
+{
+	return log ? log->entries->version : 0;
+}
+
+inline bool dict::changes_since(const size_type version, std::vector<change>& changes) const
+{
+	return log && log->entries->since(version, changes);
+}
+
+inline void dict::log_change(const change::kind_type kind, const key_type& key)
+{
+	log->entries->record(kind, log->prefix, key);
+}
+
+inline void dict::touch(const iterator i)
+{
+	if(log && log->entries->touches)
+		log_change(change::relocate, i->first);
+	hash_state &= ~ordered_hash_valid;
+	sequenced_index().relocate(begin(), i);
+}
+
+struct dict::cache_policy
+{
+	size_type capacity;
+	size_type weight;
+	weigher_type weigher;
+	evictor_type evictor;
+};
+
+namespace details
+{
+	class memory_visitor : public boost::static_visitor<dict::size_type>
+	{
+	public:
+		template<class T>
+		dict::size_type operator()(const T&) const
+		{
+			return 0;
+		}
+
+		dict::size_type operator()(const std::string& value) const
+		{
+			return value.capacity();
+		}
+
+		template<class T>
+		dict::size_type operator()(const std::vector<T>& value) const
+		{
+			return value.capacity() * sizeof(T);
+		}
+
+		dict::size_type operator()(const std::vector<bool>& value) const
+		{
+			return value.capacity() / 8;
+		}
+
+		dict::size_type operator()(const std::vector<std::string>& value) const
+		{
+			dict::size_type size = value.capacity() * sizeof(std::string);
+			for(std::vector<std::string>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				size += i->capacity();
+			return size;
+		}
+
+		dict::size_type operator()(const dict& value) const
+		{
+			dict::size_type size = sizeof(dict);
+			for(dict::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				size += dict::memory_weight(*i);
+			return size;
+		}
+
+		dict::size_type operator()(const std::vector<dict>& value) const
+		{
+			dict::size_type size = 0;
+			for(std::vector<dict>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				size += (*this)(*i);
+			return size + (value.capacity() - value.size()) * sizeof(dict);
+		}
+	};
+} // namespace details
+
+inline void dict::set_capacity(const size_type capacity, const weigher_type& weigher, const evictor_type& evictor)
+{
+	delete cache;
+	cache = 0;
+	if(!capacity)
+		return;
+
+	cache = new cache_policy;
+	cache->capacity = capacity;
+	cache->weigher = weigher;
+	cache->evictor = evictor;
+	reweigh();
+}
+
+inline void dict::reweigh()
+{
+	cache->weight = 0;
+	for(const_iterator i = begin(), end = this->end(); i != end; ++i)
+		cache->weight += weigh(*i);
+	evict(0);
+}
+
+inline void dict::clear()
+{
+	record(change::clear, key_type());
+	release_cold();
+	storage.clear();
+	if(cache)
+		cache->weight = 0;
+	cached_hash = cached_unordered_hash = 0;
+	hash_state = 0;
+}
+
+inline dict::size_type dict::capacity() const
+{
+	return cache ? cache->capacity : 0;
+}
+
+inline dict::size_type dict::weight() const
+{
+	return cache ? cache->weight : 0;
+}
+
+inline dict::size_type dict::memory_weight(const_reference value)
+{
+	// node overhead is approximated by the value plus the three index links
+	return sizeof(value_type) + 4 * sizeof(void*) + value.first.capacity()
+		+ boost::apply_visitor(details::memory_visitor(), value.second);
+}
+
+inline dict::size_type dict::weigh(const value_type& value) const
+{
+	if(!cache)
+		return 0;
+	return cache->weigher ? cache->weigher(value) : 1;
+}
+
+inline void dict::evict(const size_type keep)
+{
+	while(cache->weight > cache->capacity && size() > keep)
+	{
+		if(cache->evictor)
+			cache->evictor(back());
+		pop_back();
+	}
+}
+
+inline dict::cache_policy* dict::copy_cache(const dict& other)
+{
+	return other.cache ? new cache_policy(*other.cache) : 0;
+}
+
+// Binary (de)serialization. A dictionary is its size followed by its (key, type index, value) items.
+// Strings and vectors are prefixed by their size; numbers are written as raw bytes.
+struct dict::binary_io
+{
+	typedef boost::uint64_t length_type;
+
+	static const std::size_t max_depth = 512; // guards against corrupt input nesting without end
+	static const std::size_t chunk = 64 * 1024; // corrupt lengths fail at end of input instead of allocating
+
+	static void write_length(std::ostream& out, const std::size_t n)
+	{
+		const length_type length = n;
+		out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+	}
+
+	static bool read_length(std::istream& in, std::size_t& n)
+	{
+		length_type length;
+		if(!in.read(reinterpret_cast<char*>(&length), sizeof(length)) || length > std::size_t(-1))
+			return false;
+		n = static_cast<std::size_t>(length);
+		return true;
+	}
+
+	template<class T>
+	static bool read_array(std::istream& in, std::size_t n, std::vector<T>& values)
+	{
+		values.clear();
+		while(n)
+		{
+			const std::size_t count = std::min<std::size_t>(n, chunk / sizeof(T) + 1);
+			const std::size_t offset = values.size();
+			values.resize(offset + count);
+			if(!in.read(reinterpret_cast<char*>(&values[offset]), count * sizeof(T)))
+				return false;
+			n -= count;
+		}
+		return true;
+	}
+
+	class save_visitor : public boost::static_visitor<void>
+	{
+	public:
+		explicit save_visitor(std::ostream& out) : out(out) { }
+
+		template<class T>
+		void operator()(const T& value) const
+		{
+			out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		void operator()(const bool value) const
+		{
+			out.put(value ? 1 : 0);
+		}
+
+		void operator()(const std::string& value) const
+		{
+			write_length(out, value.size());
+			out.write(value.data(), value.size());
+		}
+
+		template<class T>
+		void operator()(const std::vector<T>& value) const
+		{
+			write_length(out, value.size());
+			if(!value.empty())
+				out.write(reinterpret_cast<const char*>(&value[0]), value.size() * sizeof(T));
+		}
+
+		void operator()(const std::vector<bool>& value) const
+		{
+			write_length(out, value.size());
+			for(std::vector<bool>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				out.put(*i ? 1 : 0);
+		}
+
+		void operator()(const std::vector<std::string>& value) const
+		{
+			write_length(out, value.size());
+			for(std::vector<std::string>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				(*this)(*i);
+		}
+
+		void operator()(const dict& value) const
+		{
+			// a frozen dictionary holds this very representation, compressed, so it is written without inflating it
+			std::string raw;
+			if(value.frozen_binary(raw))
+			{
+				out.write(raw.data(), raw.size());
+				return;
+			}
+			write_length(out, value.size());
+			for(const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+			{
+				(*this)(i->first);
+				out.put(static_cast<char>(i->second.which()));
+				boost::apply_visitor(*this, i->second);
+			}
+		}
+
+		void operator()(const std::vector<dict>& value) const
+		{
+			write_length(out, value.size());
+			for(std::vector<dict>::const_iterator i = value.begin(), end = value.end(); i != end; ++i)
+				(*this)(*i);
+		}
+
+	private:
+		std::ostream& out;
+	};
+
+	template<class T>
+	static bool read(std::istream& in, T& value, std::size_t)
+	{
+		return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+	}
+
+	static bool read(std::istream& in, bool& value, std::size_t)
+	{
+		const int c = in.get();
+		value = c == 1;
+		return c == 0 || c == 1;
+	}
+
+	static bool read(std::istream& in, std::string& value, std::size_t)
+	{
+		std::size_t n;
+		std::vector<char> bytes;
+		if(!read_length(in, n) || !read_array(in, n, bytes))
+			return false;
+		value.assign(bytes.begin(), bytes.end());
+		return true;
+	}
+
+	template<class T>
+	static bool read(std::istream& in, std::vector<T>& value, std::size_t)
+	{
+		std::size_t n;
+		return read_length(in, n) && read_array(in, n, value);
+	}
+
+	static bool read(std::istream& in, std::vector<bool>& value, std::size_t)
+	{
+		std::size_t n;
+		if(!read_length(in, n))
+			return false;
+		value.clear();
+		for(int c; n; --n)
+		{
+			if((c = in.get()) == std::istream::traits_type::eof())
+				return false;
+			value.push_back(c != 0);
+		}
+		return true;
+	}
+
+	template<class T>
+	static bool read_vector(std::istream& in, std::vector<T>& value, const std::size_t depth)
+	{
+		std::size_t n;
+		if(!read_length(in, n))
+			return false;
+		value.clear();
+		for(; n; --n)
+		{
+			value.push_back(T());
+			if(!read(in, value.back(), depth))
+				return false;
+		}
+		return true;
+	}
+
+	static bool read(std::istream& in, std::vector<std::string>& value, const std::size_t depth)
+	{
+		return read_vector(in, value, depth);
+	}
+
+	static bool read(std::istream& in, std::vector<dict>& value, const std::size_t depth)
+	{
+		return read_vector(in, value, depth);
+	}
+
+	// Default constructs the which-th alternative of the variant, then reads into it without copying.
+	template<class Iterator, class End = boost::mpl::end<types>::type>
+	struct alternative_reader
+	{
+		static bool read(std::istream& in, const int which, mapped_type& value, const std::size_t depth)
+		{
+			typedef typename boost::mpl::deref<Iterator>::type type;
+			if(which)
+				return alternative_reader<typename boost::mpl::next<Iterator>::type>::read(in, which - 1, value, depth);
+			value = type();
+			return binary_io::read(in, boost::get<type>(value), depth);
+		}
+	};
+
+	template<class End>
+	struct alternative_reader<End, End>
+	{
+		static bool read(std::istream&, const int, mapped_type&, const std::size_t)
+		{
+			return false;
+		}
+	};
+
+	// Reads a value in place, once its item is already linked into the dictionary.
+	struct read_modifier
+	{
+		read_modifier(std::istream& in, const int which, const std::size_t depth, bool& ok)
+		: in(in), which(which), depth(depth), ok(ok)
+		{
+
+		}
+
+		void operator()(value_type& value) const
+		{
+			ok = alternative_reader<boost::mpl::begin<types>::type>::read(in, which, value.second, depth);
+		}
+
+		std::istream& in;
+		const int which;
+		const std::size_t depth;
+		bool& ok;
+	};
+
+	static bool read(std::istream& in, dict& value, const std::size_t depth)
+	{
+		std::size_t n;
+		if(depth > max_depth || !read_length(in, n))
+			return false;
+		value.clear();
+		for(; n; --n)
+		{
+			value_type item;
+			if(!read(in, item.first, depth))
+				return false;
+			const int which = in.get();
+			const std::pair<iterator, bool> inserted = value.storage.push_back(item);
+			if(!in || !inserted.second)
+				return false;
+			bool ok = false;
+			value.sequenced_index().modify(inserted.first, read_modifier(in, which, depth + 1, ok));
+			if(!ok)
+				return false;
+		}
+		value.hash_state = 0;
+		return true;
+	}
+
+};
+
+#ifdef DICT_ASYNC
+namespace details
+{
+	// Output buffer that hands each full chunk to another thread for writing while the next chunk is filled.
+	class pipelined_writer : public std::streambuf
+	{
+	public:
+		explicit pipelined_writer(std::FILE* file, const std::size_t chunk = 1 << 20)
+		: file(file), current(0), ok(true)
+		{
+			buffers[0].resize(chunk);
+			buffers[1].resize(chunk);
+			setp(&buffers[0][0], &buffers[0][0] + chunk);
+		}
+
+		~pipelined_writer()
+		{
+			finish();
+		}
+
+		// Writes out everything buffered so far and waits for it. Returns true if all writes succeeded.
+		bool finish()
+		{
+			write_chunk();
+			wait();
+			return ok;
+		}
+
+	protected:
+		int_type overflow(int_type c)
+		{
+			if(!write_chunk())
+				return traits_type::eof();
+			if(!traits_type::eq_int_type(c, traits_type::eof()))
+			{
+				*pptr() = traits_type::to_char_type(c);
+				pbump(1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		int sync()
+		{
+			return write_chunk() ? 0 : -1;
+		}
+
+	private:
+		bool write_chunk()
+		{
+			wait();
+			const std::size_t n = pptr() - pbase();
+			if(n)
+			{
+				const char* data = pbase();
+				std::FILE* file = this->file;
+				pending = std::async(std::launch::async, [data, n, file]
+				{
+					return std::fwrite(data, 1, n, file) == n;
+				});
+				current ^= 1;
+				setp(&buffers[current][0], &buffers[current][0] + buffers[current].size());
+			}
+			return ok;
+		}
+
+		void wait()
+		{
+			if(pending.valid())
+				ok = pending.get() && ok;
+		}
+
+		std::FILE* file;
+		std::vector<char> buffers[2];
+		int current;
+		bool ok;
+		std::future<bool> pending;
+	};
+
+	// Input buffer that reads the next chunk on another thread while the current one is parsed.
+	class pipelined_reader : public std::streambuf
+	{
+	public:
+		explicit pipelined_reader(std::FILE* file, const std::size_t chunk = 1 << 20)
+		: file(file), current(0)
+		{
+			buffers[0].resize(chunk);
+			buffers[1].resize(chunk);
+			setg(&buffers[0][0], &buffers[0][0], &buffers[0][0]);
+			read_ahead(1);
+		}
+
+	protected:
+		int_type underflow()
+		{
+			if(gptr() < egptr())
+				return traits_type::to_int_type(*gptr());
+			if(!pending.valid())
+				return traits_type::eof();
+			const std::size_t n = pending.get();
+			current ^= 1;
+			char* data = &buffers[current][0];
+			setg(data, data, data + n);
+			if(n == buffers[current].size())
+				read_ahead(current ^ 1);
+			if(!n)
+				return traits_type::eof();
+			return traits_type::to_int_type(*gptr());
+		}
+
+	private:
+		void read_ahead(const int buffer)
+		{
+			char* data = &buffers[buffer][0];
+			const std::size_t size = buffers[buffer].size();
+			std::FILE* file = this->file;
+			pending = std::async(std::launch::async, [data, size, file]
+			{
+				return std::fread(data, 1, size, file);
+			});
+		}
+
+		std::FILE* file;
+		std::vector<char> buffers[2];
+		int current;
+		std::future<std::size_t> pending;
+	};
+} // namespace details
+#endif // DICT_ASYNC
+
+struct dict::cold_storage
+{
+	cold_storage()
+	: raw_size(0), size(0), values(0), frozen(false), touched(false)
+	{
+
+	}
+
+	// The caller holds other.mutex.
+	cold_storage(const cold_storage& other)
+	: compressed(other.compressed)
+	, raw_size(other.raw_size)
+	, size(other.size)
+	, values(other.values)
+	, frozen(other.frozen.load())
+	, touched(other.touched.load())
+	{
+
+	}
+
+	std::vector<char> compressed; // binary representation of the values while frozen
+	size_type raw_size;
+	size_type size;
+	size_type values; // size_recursive() while frozen
+	boost::atomic<bool> frozen; // cleared by const accessors, possibly from several threads at once
+	boost::atomic<bool> touched; // accessed since the last compact()
+	details::cold_mutex mutex; // held while inflating or copying the compressed form
+};
+
+struct dict::compact_modifier
+{
+	compact_modifier(const size_type min_size, size_type& count, size_type& values)
+	: min_size(min_size), count(count), values(values)
+	{
+
+	}
+
+	void operator()(value_type& value) const
+	{
+		if(dict* d = boost::get<dict>(&value.second))
+			values += d->compact_sub(min_size, count);
+		else if(std::vector<dict>* v = boost::get<std::vector<dict> >(&value.second))
+			for(std::vector<dict>::iterator i = v->begin(), end = v->end(); i != end; ++i)
+				values += i->compact_sub(min_size, count);
+	}
+
+	const size_type min_size;
+	size_type& count;
+	size_type& values;
+};
+
+inline void dict::freeze()
+{
+	if(frozen())
+		return;
+	// hashes are only maintained once computed; compute them now so that comparing a frozen dict doesn't inflate it
+	hash();
+	unordered_hash();
+	std::ostringstream out;
+	const binary_io::save_visitor visitor(out);
+	visitor(*this);
+	const std::string raw = out.str();
+
+	if(!cold)
+		cold = new cold_storage;
+	cold->compressed.clear();
+	details::lz_compress(raw.data(), raw.size(), cold->compressed);
+	std::vector<char>(cold->compressed).swap(cold->compressed);
+	cold->raw_size = raw.size();
+	cold->size = storage.size();
+	cold->values = size_recursive();
+	cold->frozen = true;
+	cold->touched = false;
+	storage_type().swap(storage);
+}
+
+inline bool dict::frozen() const
+{
+	return cold && cold->frozen;
+}
+
+inline dict::size_type dict::cold_size() const
+{
+	return cold->frozen ? cold->size : storage.size();
+}
+
+inline void dict::wake_cold() const
+{
+	// const accessors may run concurrently, so only write the flags when they change
+	if(!cold->touched)
+		cold->touched = true;
+	if(!cold->frozen)
+		return;
+	const details::cold_lock lock(cold->mutex);
+	if(!cold->frozen)
+		return; // inflated by another thread meanwhile
+
+	// the compressed form was produced by freeze(), so it only fails to decode if memory was corrupted
+	std::string raw;
+	dict values;
+	bool inflated = details::lz_decompress(cold->compressed, cold->raw_size, raw);
+	if(inflated)
+	{
+		std::istringstream in(raw);
+		inflated = binary_io::read(in, values, 0) && values.size() == cold->size;
+	}
+	if(!inflated)
+		throw std::runtime_error("dict: frozen dictionary is corrupt");
+	storage.swap(values.storage);
+	std::vector<char>().swap(cold->compressed);
+	cold->frozen = false;
+}
+
+// Decompresses the binary representation of a frozen dictionary, leaving the dictionary frozen.
+inline bool dict::frozen_binary(std::string& raw) const
+{
+	if(!frozen())
+		return false;
+	const details::cold_lock lock(cold->mutex);
+	return cold->frozen && details::lz_decompress(cold->compressed, cold->raw_size, raw);
+}
+
+inline dict::size_type dict::compact(const size_type min_size)
+{
+	size_type count = 0;
+	compact_impl(min_size, count);
+	return count;
+}
+
+inline dict::size_type dict::compact_impl(const size_type min_size, size_type& count)
+{
+	size_type values = size();
+	for(iterator i = begin(), end = this->end(); i != end; ++i)
+		if(boost::get<dict>(&i->second) || boost::get<std::vector<dict> >(&i->second))
+			sequenced_index().modify(i, compact_modifier(min_size, count, values));
+	return values;
+}
+
+inline dict::size_type dict::compact_sub(const size_type min_size, size_type& count)
+{
+	if(frozen())
+		return cold->values;
+	if(cold && !cold->touched)
+	{
+		freeze();
+		++count;
+		return cold->values;
+	}
+
+	const size_type values = compact_impl(min_size, count);
+	if(cold || values >= min_size)
+	{
+		if(!cold)
+			cold = new cold_storage;
+		cold->frozen = false;
+		cold->touched = false;
+	}
+	return values;
+}
+
+inline void dict::release_cold()
+{
+	delete cold;
+	cold = 0;
+}
+
+inline dict::cold_storage* dict::copy_cold(const dict& other)
+{
+	if(!other.cold)
+		return 0;
+	// other may be inflated concurrently through a const reference, so decide under its lock
+	const details::cold_lock lock(other.cold->mutex);
+	return other.cold->frozen ? new cold_storage(*other.cold) : 0;
+}
+
+//! Forward iterator over the values of a dictionary and all of its sub-dictionaries, in depth-first order.
+//! Dictionaries inside a std::vector<dict> are visited too, using their index as a sub-key.
+//! Optionally only yields values whose paths match a pattern or satisfy a predicate.
+class dict::recursive_const_iterator
+: public boost::iterator_facade<dict::recursive_const_iterator, const dict::value_type, boost::forward_traversal_tag>
+{
+public:
+	typedef boost::function<bool(const key_type&, const_reference)> predicate_type; //!< Filter on (path, value).
+
+	//! Creates an end iterator.
+	recursive_const_iterator()
+	: current(0)
+	{
+
+	}
+
+	//! Returns the "::" delimited path of the current value.
+	const key_type& path() const
+	{
+		return current_path;
+	}
+
+private:
+	friend class boost::iterator_core_access;
+	friend class dict;
+
+	struct frame
+	{
+		const_iterator first; // remaining values of a dictionary
+		const_iterator last;
+		const std::vector<dict>* v; // or remaining dictionaries of a std::vector<dict>
+		std::size_t index;
+		std::size_t last_index;
+		std::size_t prefix; // length of the path leading to this level
+		std::size_t depth;
+	};
+
+	recursive_const_iterator(const dict& d, const boost::shared_ptr<const details::path_pattern>& pattern, const predicate_type& predicate)
+	: current(0)
+	, pattern(pattern)
+	, predicate(predicate)
+	{
+		push(d, 0);
+		increment();
+	}
+
+	const value_type& dereference() const
+	{
+		return *current;
+	}
+
+	bool equal(const recursive_const_iterator& other) const
+	{
+		return current == other.current;
+	}
+
+	void push(const dict& d, const std::size_t depth)
+	{
+		if(pattern && depth >= pattern->size())
+			return;
+		frame f;
+		f.v = 0;
+		f.first = d.begin();
+		f.last = d.end();
+		if(const key_type* key = pattern ? pattern->literal_key(depth) : 0)
+		{
+			// only one key can match, so look it up rather than scanning
+			f.first = d.find(*key);
+			if(f.first != f.last)
+				f.last = boost::next(f.first);
+		}
+		f.prefix = current_path.size();
+		f.depth = depth;
+		stack.push_back(f);
+	}
+
+	void push(const std::vector<dict>& v, const std::size_t depth)
+	{
+		if(pattern && depth >= pattern->size())
+			return;
+		frame f;
+		f.v = &v;
+		f.index = 0;
+		f.last_index = v.size();
+		if(const key_type* key = pattern ? pattern->literal_key(depth) : 0)
+		{
+			std::size_t index;
+			if(details::parse_index(*key, index) && index < v.size())
+				f.index = index, f.last_index = index + 1;
+			else
+				f.index = f.last_index;
+		}
+		f.prefix = current_path.size();
+		f.depth = depth;
+		stack.push_back(f);
+	}
+
+	void increment()
+	{
+		current = 0;
+		while(!stack.empty())
+		{
+			frame& f = stack.back();
+			current_path.resize(f.prefix);
+			if(f.depth)
+				current_path += "::";
+
+			const std::size_t depth = f.depth;
+			if(f.v)
+			{
+				if(f.index == f.last_index)
+				{
+					stack.pop_back();
+					continue;
+				}
+				const dict& d = (*f.v)[f.index];
+				const std::string key = boost::lexical_cast<std::string>(f.index++);
+				if(!pattern || pattern->match(depth, key))
+				{
+					current_path += key;
+					push(d, depth + 1);
+				}
+				continue;
+			}
+
+			if(f.first == f.last)
+			{
+				stack.pop_back();
+				continue;
+			}
+			const value_type& value = *f.first++;
+			current_path += value.first;
+
+			bool yield = true, descend = true;
+			if(pattern)
+			{
+				const bool match = pattern->match(depth, value.first);
+				yield = match && depth + 1 == pattern->size();
+				descend = match && depth + 1 < pattern->size();
+			}
+			if(descend)
+			{
+				if(const dict* d = boost::get<dict>(&value.second))
+					push(*d, depth + 1);
+				else if(const std::vector<dict>* v = boost::get<std::vector<dict> >(&value.second))
+					push(*v, depth + 1);
+			}
+			if(yield && (!predicate || predicate(current_path, value)))
+			{
+				current = &value;
+				return;
+			}
+		}
+	}
+
+	std::vector<frame> stack;
+	key_type current_path;
+	const value_type* current;
+	boost::shared_ptr<const details::path_pattern> pattern;
+	predicate_type predicate;
+};
+
+template<class Matcher>
+struct dict::erase_recursive_modifier
+{
+	erase_recursive_modifier(const Matcher& matcher, key_type& path, const std::size_t depth, size_type& count, journal_link* log)
+	: matcher(matcher), path(path), depth(depth), count(count), log(log)
+	{
+
+	}
+
+	void operator()(value_type& value) const
+	{
+		// paths are relative to where the erase started, so sub-dictionaries share the same journal link
+		if(dict* d = boost::get<dict>(&value.second))
+		{
+			const journal_scope scope(*d, log);
+			count += d->erase_recursive_impl(matcher, path, depth);
+		}
+		else if(std::vector<dict>* v = boost::get<std::vector<dict> >(&value.second))
+		{
+			const std::size_t prefix = path.size();
+			for(std::size_t index = 0; index < v->size(); ++index)
+			{
+				const std::string key = boost::lexical_cast<std::string>(index);
+				if(!matcher.descend(key, depth))
+					continue;
+				path.resize(prefix);
+				path += "::" + key;
+				const journal_scope scope((*v)[index], log);
+				count += (*v)[index].erase_recursive_impl(matcher, path, depth + 1);
+			}
+			path.resize(prefix);
+		}
+	}
+
+	const Matcher& matcher;
+	key_type& path;
+	const std::size_t depth;
+	size_type& count;
+	journal_link* log;
+};
+
+template<class Matcher>
+inline dict::size_type dict::erase_recursive_impl(const Matcher& matcher, key_type& path, const std::size_t depth)
+{
+	iterator i = begin(), last = end();
+	if(const key_type* key = matcher.literal_key(depth))
+	{
+		i = find(*key);
+		if(i != last)
+			last = boost::next(i);
+	}
+
+	size_type count = 0;
+	const std::size_t prefix = path.size();
+	while(i != last)
+	{
+		path.resize(prefix);
+		if(depth)
+			path += "::";
+		path += i->first;
+		if(matcher.erase(path, *i, depth))
+		{
+			record(change::erase, path);
+			detach(*i);
+			i = sequenced_index().erase(i);
+			++count;
+			continue;
+		}
+		if(matcher.descend(i->first, depth)
+			&& (boost::get<dict>(&i->second) || boost::get<std::vector<dict> >(&i->second)))
+		{
+			size_type erased = 0;
+			const size_type weight = weigh(*i);
+			sequenced_index().modify(i, erase_recursive_modifier<Matcher>(matcher, path, depth + 1, erased, log));
+			if(erased)
+			{
+				hash_state = 0;
+				if(cache)
+					cache->weight += weigh(*i) - weight;
+			}
+			count += erased;
+		}
+		++i;
+	}
+	path.resize(prefix);
+	return count;
+}
+
+struct dict::patch_modifier
+{
+	patch_modifier(const dict& changes, journal_link* log)
+	: changes(changes), log(log)
+	{
+
+	}
+
+	void operator()(value_type& value) const
+	{
+		dict& d = boost::get<dict>(value.second);
+		const journal_scope scope(d, log);
+		d.patch(changes);
+	}
+
+	const dict& changes;
+	journal_link* log;
+};
+
+struct dict::merge_modifier
+{
+	merge_modifier(const dict& other, const merge_policy policy, const merge_resolver& resolve, key_type& path, journal_link* log)
+	: other(other), policy(policy), resolve(resolve), path(path), log(log)
+	{
+
+	}
+
+	void operator()(value_type& value) const
+	{
+		dict& d = boost::get<dict>(value.second);
+		const journal_scope scope(d, log);
+		d.merge_impl(other, policy, resolve, path);
+	}
+
+	const dict& other;
+	const merge_policy policy;
+	const merge_resolver& resolve;
+	key_type& path;
+	journal_link* log;
+};
+
+namespace details
+{
+	// Compares two values. Sub-dictionaries are hashed first, so that unequal ones are usually told apart by their
+	// cached hashes, and equal hashes are confirmed by operator==.
+	class same_visitor : public boost::static_visitor<bool>
+	{
+	public:
+		template<class T, class U>
+		bool operator()(const T&, const U&) const
+		{
+			return false;
+		}
+
+		template<class T>
+		bool operator()(const T& lhs, const T& rhs) const
+		{
+			return lhs == rhs;
+		}
+
+		bool operator()(const dict& lhs, const dict& rhs) const
+		{
+			return lhs.hash() == rhs.hash() && lhs == rhs;
+		}
+
+		bool operator()(const std::vector<dict>& lhs, const std::vector<dict>& rhs) const
+		{
+			if(lhs.size() != rhs.size())
+				return false;
+			for(std::vector<dict>::size_type n = 0; n < lhs.size(); ++n)
+				if(!(*this)(lhs[n], rhs[n]))
+					return false;
+			return true;
+		}
+	};
+
+	template<class InputIterator>
+	int compare(InputIterator lhs, InputIterator lhs_last, InputIterator rhs, InputIterator rhs_last);
+
+	// Three-way comparison of two values of the same type, descending into each sub-dictionary once.
+	// Comparing with < both ways instead would take time exponential in the nesting depth.
+	class compare_visitor : public boost::static_visitor<int>
+	{
+	public:
+		template<class T, class U>
+		int operator()(const T&, const U&) const
+		{
+			return 0; // unreachable: values of different types are ordered by type first
+		}
+
+		template<class T>
+		int operator()(const T& lhs, const T& rhs) const
+		{
+			return lhs < rhs ? -1 : rhs < lhs ? 1 : 0;
+		}
+
+		int operator()(const dict& lhs, const dict& rhs) const
+		{
+			return compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+		}
+
+		int operator()(const std::vector<dict>& lhs, const std::vector<dict>& rhs) const
+		{
+			for(std::vector<dict>::size_type n = 0; n < lhs.size() && n < rhs.size(); ++n)
+				if(const int order = (*this)(lhs[n], rhs[n]))
+					return order;
+			return lhs.size() < rhs.size() ? -1 : rhs.size() < lhs.size() ? 1 : 0;
+		}
+	};
+
+	// Lexicographical three-way comparison of two sequences of values, consistent with operator<.
+	template<class InputIterator>
+	int compare(InputIterator lhs, InputIterator lhs_last, InputIterator rhs, InputIterator rhs_last)
+	{
+		for(; lhs != lhs_last && rhs != rhs_last; ++lhs, ++rhs)
+		{
+			if(const int order = lhs->first.compare(rhs->first))
+				return order < 0 ? -1 : 1;
+			if(lhs->second.which() != rhs->second.which())
+				return lhs->second.which() < rhs->second.which() ? -1 : 1;
+			if(const int order = boost::apply_visitor(compare_visitor(), lhs->second, rhs->second))
+				return order;
+		}
+		return lhs != lhs_last ? 1 : rhs != rhs_last ? -1 : 0;
+	}
+} // namespace details
+
+inline dict dict::diff(const dict& a, const dict& b)
+{
+	dict changes;
+	if(a.hash() == b.hash() && a == b)
+		return changes;
+
+	dict added, modified, nested;
+	std::vector<key_type> removed;
+	for(const_iterator i = b.begin(), end = b.end(); i != end; ++i)
+	{
+		const key_index_type::const_iterator j = a.key_index().find(i->first);
+		if(j == a.key_index().end())
+		{
+			added.put(*i, true);
+		}
+		else if(!boost::apply_visitor(details::same_visitor(), j->second, i->second))
+		{
+			const dict* lhs = boost::get<dict>(&j->second);
+			const dict* rhs = boost::get<dict>(&i->second);
+			if(lhs && rhs)
+			{
+				const dict sub = diff(*lhs, *rhs);
+				if(!sub.empty())
+					nested.add(i->first, sub);
+			}
+			else
+			{
+				modified.put(*i, true);
+			}
+		}
+	}
+
+	// patch() keeps surviving keys in place and appends added ones, so b's order only needs recording if that differs
+	bool reordered = false;
+	const_iterator expected = b.begin();
+	for(const_iterator i = a.begin(), end = a.end(); i != end; ++i)
+	{
+		if(!b.count(i->first))
+			removed.push_back(i->first);
+		else if(!reordered && (expected == b.end() || (expected++)->first != i->first))
+			reordered = true;
+	}
+	for(const_iterator i = added.begin(), end = added.end(); !reordered && i != end; ++i)
+		if(expected == b.end() || (expected++)->first != i->first)
+			reordered = true;
+
+	if(!removed.empty())
+		changes.add("removed", removed);
+	if(!added.empty())
+		changes.add("added", added);
+	if(!modified.empty())
+		changes.add("modified", modified);
+	if(!nested.empty())
+		changes.add("nested", nested);
+	if(reordered)
+	{
+		std::vector<key_type> order;
+		order.reserve(b.size());
+		for(const_iterator i = b.begin(), end = b.end(); i != end; ++i)
+			order.push_back(i->first);
+		changes.add("order", order);
+	}
+	return changes;
+}
+
+inline void dict::patch(const dict& changes)
+{
+	std::vector<key_type> keys;
+	if(changes.get("removed", keys))
+		for(std::vector<key_type>::const_iterator i = keys.begin(), end = keys.end(); i != end; ++i)
+			erase(*i);
+
+	if(const dict* values = changes.find_dict("modified"))
+		for(const_iterator i = values->begin(), end = values->end(); i != end; ++i)
+			put(*i, true);
+
+	if(const dict* subs = changes.find_dict("nested"))
+		for(const_iterator i = subs->begin(), end = subs->end(); i != end; ++i)
+		{
+			const iterator j = find(i->first);
+			const dict* sub = boost::get<dict>(&i->second);
+			if(j == this->end() || !sub || !boost::get<dict>(&j->second))
+				continue;
+			journal_link link;
+			if(log)
+			{
+				link.entries = log->entries;
+				link.prefix = log->prefix + i->first + "::";
+			}
+			const size_type weight = weigh(*j);
+			sequenced_index().modify(j, patch_modifier(*sub, log ? &link : 0));
+			hash_state = 0;
+			if(cache)
+				cache->weight += weigh(*j) - weight;
+		}
+
+	if(const dict* values = changes.find_dict("added"))
+		for(const_iterator i = values->begin(), end = values->end(); i != end; ++i)
+			put(*i, true);
+
+	keys.clear();
+	if(changes.get("order", keys))
+		for(std::vector<key_type>::const_iterator i = keys.begin(), end = keys.end(); i != end; ++i)
+		{
+			const iterator j = find(*i);
+			if(j != this->end())
+				relocate(this->end(), j);
+		}
+}
+
+inline void dict::update(const dict& other)
+{
+	if(&other == this)
+		return;
+	wake();
+	if(storage.empty() && !log && !cache)
+	{
+		// nothing can collide, so take the (possibly parallel) copy along with its hashes
+		release_cold();
+		cold = copy_cold(other);
+		if(!cold)
+			copy_storage(other).swap(storage);
+		cached_hash = other.cached_hash;
+		cached_unordered_hash = other.cached_unordered_hash;
+		hash_state = other.hash_state;
+		return;
+	}
+
+	key_index().reserve(size() + other.size());
+	for(const_iterator i = other.begin(), end = other.end(); i != end; ++i)
+		put(key_index().find(i->first), *i, true);
+}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+inline void dict::update(dict&& other)
+{
+	if(&other == this)
+		return;
+	wake();
+	other.wake();
+	if(storage.empty() && !log && !cache)
+	{
+		storage.swap(other.storage);
+		cached_hash = other.cached_hash;
+		cached_unordered_hash = other.cached_unordered_hash;
+		hash_state = other.hash_state;
+		other.clear();
+		return;
+	}
+
+	#ifdef DICT_NODE_HANDLES
+	key_index().reserve(size() + other.size());
+	while(!other.storage.empty())
+	{
+		storage_type::node_type node = other.storage.extract(other.storage.begin());
+		put(node);
+	}
+	#else
+	update(static_cast<const dict&>(other));
+	#endif // DICT_NODE_HANDLES
+	other.clear();
+}
+#endif // BOOST_NO_CXX11_RVALUE_REFERENCES
+
+inline void dict::merge(const dict& other, const merge_policy policy)
+{
+	key_type path;
+	merge_impl(other, policy, merge_resolver(), path);
+}
+
+inline void dict::merge(const dict& other, const merge_resolver& resolve)
+{
+	key_type path;
+	merge_impl(other, merge_overwrite, resolve, path);
+}
+
+inline void dict::merge_impl(const dict& other, const merge_policy policy, const merge_resolver& resolve, key_type& path)
+{
+	if(&other == this)
+		return;
+	key_index().reserve(size() + other.size());
+	const std::size_t prefix = path.size();
+	for(const_iterator i = other.begin(), end = other.end(); i != end; ++i)
+	{
+		const key_index_type::iterator j = key_index().find(i->first);
+		if(j == key_index().end())
+		{
+			put(j, *i, true);
+			continue;
+		}
+
+		path.resize(prefix);
+		if(prefix)
+			path += "::";
+		path += i->first;
+		if(const dict* sub = boost::get<dict>(&i->second))
+			if(boost::get<dict>(&j->second))
+			{
+				journal_link link;
+				if(log)
+				{
+					link.entries = log->entries;
+					link.prefix = log->prefix + i->first + "::";
+				}
+				detach(*j);
+				key_index().modify(j, merge_modifier(*sub, policy, resolve, path, log ? &link : 0));
+				attach(*j, false);
+				continue;
+			}
+
+		if(resolve)
+			put(j, value_type(i->first, resolve(path, j->second, i->second)), true);
+		else if(policy == merge_overwrite)
+			put(j, *i, true);
+	}
+	path.resize(prefix);
+}
+
+inline dict::recursive_range dict::find_recursive(const key_type& pattern) const
+{
+	const boost::shared_ptr<const details::path_pattern> p(new details::path_pattern(pattern));
+	return recursive_range(recursive_const_iterator(*this, p, recursive_const_iterator::predicate_type()), recursive_const_iterator());
+}
+
+template<class Predicate>
+inline dict::recursive_range dict::find_recursive_if(Predicate pred) const
+{
+	return recursive_range(recursive_const_iterator(*this, boost::shared_ptr<const details::path_pattern>(), pred), recursive_const_iterator());
+}
+
+inline dict::size_type dict::count_recursive(const key_type& pattern) const
+{
+	const recursive_range range = find_recursive(pattern);
+	size_type count = 0;
+	for(recursive_const_iterator i = range.begin(), end = range.end(); i != end; ++i)
+		++count;
+	return count;
+}
+
+inline dict::size_type dict::erase_recursive(const key_type& pattern)
+{
+	key_type path;
+	return erase_recursive_impl(details::path_pattern(pattern), path, 0);
+}
+
+template<class Predicate>
+inline dict::size_type dict::erase_if(Predicate pred)
+{
+	size_type count = 0;
+	for(iterator i = begin(), end = this->end(); i != end;)
+	{
+		if(pred(*i))
+		{
+			record(change::erase, i->first);
+			detach(*i);
+			i = sequenced_index().erase(i);
+			++count;
+		}
+		else
+		{
+			++i;
+		}
+	}
+	return count;
+}
 
-	for(std::vector<std::string>::const_iterator end = keys.end() - 1; i != end; ++i)
-		if(!temp.get(*i, temp))
+template<class Predicate>
+inline dict::size_type dict::erase_recursive_if(Predicate pred)
+{
+	key_type path;
+	return erase_recursive_impl(details::path_predicate<Predicate>(pred), path, 0);
+}
+
+inline void dict::save(std::ostream& out) const
+{
+	out.write("dict", 4);
+	out.put(1); // format version
+	const binary_io::save_visitor visitor(out);
+	visitor(*this);
+}
+
+inline bool dict::load(std::istream& in)
+{
+	char magic[5];
+	if(!in.read(magic, sizeof(magic)) || std::string(magic, 4) != "dict" || magic[4] != 1)
+		return false;
+	dict rvalue;
+	if(!binary_io::read(in, rvalue, 0))
+		return false;
+
+	// take only the values, unlike swap(), so that the journal and cache mode stay with this dictionary
+	record(change::reset, key_type());
+	release_cold();
+	storage.swap(rvalue.storage);
+	hash_state = 0;
+	if(cache)
+		reweigh();
+	return true;
+}
+
+#ifdef DICT_ASYNC
+inline std::future<bool> dict::save_async(dict snapshot, const std::string& path)
+{
+	return save_async(boost::shared_ptr<const dict>(new dict(std::move(snapshot))), path);
+}
+
+inline std::future<bool> dict::save_async(const boost::shared_ptr<const dict>& snapshot, const std::string& path)
+{
+	return std::async(std::launch::async, [](const boost::shared_ptr<const dict>& snapshot, const std::string& path)
+	{
+		std::FILE* file = std::fopen(path.c_str(), "wb");
+		if(!file)
 			return false;
+		bool ok;
+		{
+			details::pipelined_writer buffer(file);
+			std::ostream out(&buffer);
+			snapshot->save(out);
+			ok = out && buffer.finish();
+		}
+		return std::fclose(file) == 0 && ok;
+	}, snapshot, path);
+}
+
+inline std::future<dict> dict::load_async(const std::string& path)
+{
+	return std::async(std::launch::async, [](const std::string& path)
+	{
+		std::FILE* file = std::fopen(path.c_str(), "rb");
+		if(!file)
+			throw std::ios_base::failure("dict: can not open " + path);
+		dict rvalue;
+		bool ok;
+		{
+			details::pipelined_reader buffer(file);
+			std::istream in(&buffer);
+			ok = rvalue.load(in);
+		}
+		std::fclose(file);
+		if(!ok)
+			throw std::ios_base::failure("dict: invalid file " + path);
+		return rvalue;
+	}, path);
+}
+#endif // DICT_ASYNC
 
-	return temp.get(keys.back(), value);
+inline std::ostream& operator<<(std::ostream& o, const dict& d)
+{
+	o << d.str();
+	return o;
 }
 
-inline dict::size_type dict::size_recursive() const
+template<class T>
+inline typename boost::enable_if<dict_implicitly_supports<T>, void>::type
+dict::add_impl(const dict::key_type& key, const T& value, const bool back)
+{
+	add_impl(key, details::implicit_cast<typename dict_preferred_type<T>::type>(value), back);
+}
+
+inline std::string dict::str() const
+{
+	std::string rvalue = "{";
+	#ifdef DICT_PARALLEL
+	const std::size_t chunks = details::parallel_chunks(size());
+	if(chunks > 1)
+	{
+		const std::vector<const_iterator> bounds = details::partition(begin(), size(), chunks);
+		const std::vector<std::string> parts = details::parallel_apply(chunks, [&bounds](std::size_t c)
+		{
+			std::string part;
+			details::append_str(bounds[c], bounds[c + 1], part);
+			return part;
+		});
+		for(std::size_t c = 0; c < chunks; ++c)
+		{
+			if(c)
+				rvalue += ", ";
+			rvalue += parts[c];
+		}
+		rvalue += "}";
+		return rvalue;
+	}
+	#endif // DICT_PARALLEL
+	details::append_str(begin(), end(), rvalue);
+	rvalue += "}";
+	return rvalue;
+}
+
+inline std::size_t dict::hash() const
+{
+	if(!(hash_state & ordered_hash_valid))
+	{
+		std::size_t seed = 0;
+		for(const_iterator i = begin(), end = this->end(); i != end; ++i)
+			boost::hash_combine(seed, details::item_hash(*i, true));
+		cached_hash = seed;
+		hash_state |= ordered_hash_valid;
+	}
+	return cached_hash;
+}
+
+inline std::size_t dict::unordered_hash() const
+{
+	if(!(hash_state & unordered_hash_valid))
+	{
+		std::size_t sum = 0;
+		for(const_iterator i = begin(), end = this->end(); i != end; ++i)
+			sum += details::mix_hash(details::item_hash(*i, false));
+		cached_unordered_hash = sum;
+		hash_state |= unordered_hash_valid;
+	}
+	return cached_unordered_hash;
+}
+
+inline void dict::detach(const value_type& value)
+{
+	if(cache)
+		cache->weight -= weigh(value);
+	if(hash_state & unordered_hash_valid)
+		cached_unordered_hash -= details::mix_hash(details::item_hash(value, false));
+	hash_state &= ~ordered_hash_valid;
+}
+
+inline void dict::attach(const value_type& value, const bool back)
+{
+	if(cache)
+		cache->weight += weigh(value);
+	if(hash_state & unordered_hash_valid)
+		cached_unordered_hash += details::mix_hash(details::item_hash(value, false));
+	if(back && (hash_state & ordered_hash_valid))
+		boost::hash_combine(cached_hash, details::item_hash(value, true));
+	else
+		hash_state &= ~ordered_hash_valid;
+}
+
+inline void dict::sort()
+{
+	#ifdef DICT_ORDERED_INDEX
+	// the ordered index already knows the sorted order
+	record(change::reorder, key_type());
+	hash_state &= ~ordered_hash_valid;
+	sequenced_index().rearrange(ordered_index().begin());
+	#else
+	sort(details::key_less());
+	#endif // DICT_ORDERED_INDEX
+}
+
+#ifdef DICT_ORDERED_INDEX
+inline dict::key_range_type dict::prefix_range(const key_type& prefix) const
+{
+	// keys starting with the prefix sort before the prefix with its last incrementable character incremented
+	key_type last = prefix;
+	while(!last.empty() && static_cast<unsigned char>(last[last.size() - 1]) == 0xff)
+		last.erase(last.size() - 1);
+	if(last.empty())
+		return key_range_type(lower_bound(prefix), key_end());
+	++last[last.size() - 1];
+	return key_range(prefix, last);
+}
+#endif // DICT_ORDERED_INDEX
+
+inline unsigned dict::parallelism()
+{
+	#ifdef DICT_PARALLEL
+	return details::parallelism();
+	#else
+	return 1;
+	#endif // DICT_PARALLEL
+}
+
+inline void dict::parallelism(unsigned n)
+{
+	#ifdef DICT_PARALLEL
+	details::parallelism() = std::max(1u, n);
+	#else
+	boost::ignore_unused(n);
+	#endif // DICT_PARALLEL
+}
+
+inline dict::storage_type dict::copy_storage(const dict& other)
+{
+	#ifdef DICT_PARALLEL
+	const std::size_t chunks = details::parallel_chunks(other.size());
+	if(chunks > 1)
+	{
+		// deep copy the values in parallel, then link them into the indexes serially
+		const std::vector<const_iterator> bounds = details::partition(other.begin(), other.size(), chunks);
+		std::vector<std::vector<value_type> > parts = details::parallel_apply(chunks, [&bounds](std::size_t c)
+		{
+			return std::vector<value_type>(bounds[c], bounds[c + 1]);
+		});
+		storage_type rvalue;
+		rvalue.get<1>().reserve(other.size());
+		for(std::size_t c = 0; c < chunks; ++c)
+			for(std::vector<value_type>::iterator i = parts[c].begin(), end = parts[c].end(); i != end; ++i)
+				rvalue.push_back(std::move(*i));
+		return rvalue;
+	}
+	#endif // DICT_PARALLEL
+	return other.storage;
+}
+
+template<class T>
+inline bool dict::get(const key_type& key, T& value) const
+{
+	const key_index_type::const_iterator i = key_index().find(key);
+	if(i == key_index().end())
+		return false;
+	return boost::apply_visitor(details::get_visitor<T>(value), i->second);
+}
+
+inline dict::size_type dict::get(batch& keys) const
 {
+	const key_index_type& index = key_index();
+	const size_type n = keys.slots.size();
+	keys.hits.resize(n);
+
+	// touch every bucket and prefetch the first node chained to it before following any chain.
+	// This is only a hint: hash % bucket_count() is how Boost.MultiIndex maps hashes to buckets today, but it is not
+	// part of its interface, and the public bucket(key) would hash every key again. The lookups below go through
+	// find(), so a different mapping would only make the prefetches useless, never the results wrong.
+	const size_type buckets = index.bucket_count();
+	for(size_type k = 0; k < n; ++k)
+	{
+		const size_type bucket = keys.slots[k].hash % buckets;
+		const key_index_type::const_local_iterator i = index.begin(bucket);
+		if(i != index.end(bucket))
+			DICT_PREFETCH(&*i);
+	}
+
+	for(size_type k = 0; k < n; ++k)
+	{
+		const key_index_type::const_iterator i = index.find(keys.slots[k], batch::slot_hash(), batch::slot_equal());
+		keys.hits[k] = i == index.end() ? 0 : &*i;
+	}
+
 	size_type count = 0;
-	for(storage_type::const_iterator i = storage.begin(), end = storage.end(); i != end; ++i)
-		boost::apply_visitor(details::size_visitor(count), i->second);
+	for(size_type k = 0; k < n; ++k)
+	{
+		batch::slot& s = keys.slots[k];
+		s.found = keys.hits[k] && s.assign(keys.hits[k]->second, s.value);
+		count += s.found;
+	}
+	return count;
+}
+
+inline dict::size_type dict::get(batch& keys)
+{
+	const size_type count = static_cast<const dict&>(*this).get(keys);
+	if(cache)
+		for(std::vector<const value_type*>::const_iterator i = keys.hits.begin(), end = keys.hits.end(); i != end; ++i)
+			if(*i)
+				touch(sequenced_index().iterator_to(**i));
 	return count;
 }
 
+inline dict dict::get(const key_type& key) const
+{
+	dict rvalue;
+	get(key, rvalue);
+	return rvalue;
+}
+
+template<class T>
+inline bool dict::get(const key_type& key, T& value)
+{
+	const key_index_type::iterator i = key_index().find(key);
+	if(i == key_index().end())
+		return false;
+	if(cache)
+		touch(storage.project<0>(i));
+	return boost::apply_visitor(details::get_visitor<T>(value), i->second);
+}
+
+inline dict dict::get(const key_type& key)
+{
+	dict rvalue;
+	get(key, rvalue);
+	return rvalue;
+}
+
+template<class T>
+inline std::pair<dict::iterator, bool> dict::insert(const std::pair<key_type, T>& value)
+{
+	iterator i = find(value.first);
+	if(i == end())
+		return std::make_pair(i, false);
+	const bool rvalue = add(value.first, value.second);
+	return std::make_pair(find(value.first), rvalue);
+}
+
+template<class T>
+inline bool dict::get_recursive(const key_type& key, T& value) const
+{
+	// walk down by pointer rather than copying each sub-dictionary
+	std::vector<key_type> keys;
+	details::split_path(key, keys);
+	const dict* d = this;
+	for(std::vector<key_type>::size_type n = 0; n < keys.size(); ++n)
+	{
+		const key_index_type::const_iterator i = d->key_index().find(keys[n]);
+		if(i == d->key_index().end())
+			return false;
+		if(n + 1 == keys.size())
+			return boost::apply_visitor(details::get_visitor<T>(value), i->second);
+		if(const dict* child = boost::get<dict>(&i->second))
+		{
+			d = child;
+			continue;
+		}
+
+		const std::vector<dict>* v = boost::get<std::vector<dict> >(&i->second);
+		std::size_t index;
+		if(!v || !details::parse_index(keys[++n], index) || index >= v->size())
+			return false;
+		if(n + 1 == keys.size())
+			return details::get_visitor<T>(value)((*v)[index]);
+		d = &(*v)[index];
+	}
+	return false;
+}
+
+inline dict::size_type dict::size_recursive() const
+{
+	if(frozen())
+		return cold->values;
+	#ifdef DICT_PARALLEL
+	const std::size_t chunks = details::parallel_chunks(size());
+	if(chunks > 1)
+	{
+		const std::vector<const_iterator> bounds = details::partition(begin(), size(), chunks);
+		const std::vector<size_type> counts = details::parallel_apply(chunks, [&bounds](std::size_t c)
+		{
+			return details::size_recursive(bounds[c], bounds[c + 1]);
+		});
+		size_type count = 0;
+		for(std::size_t c = 0; c < chunks; ++c)
+			count += counts[c];
+		return count;
+	}
+	#endif // DICT_PARALLEL
+	return details::size_recursive(begin(), end());
+}
+
 inline bool operator==(const dict& lhs, const dict& rhs)
 {
-	return lhs.storage == rhs.storage;
+	// short-circuit on structural hashes that happen to be cached already
+	if(lhs.size() != rhs.size())
+		return false;
+	if((lhs.hash_state & rhs.hash_state & dict::ordered_hash_valid) && lhs.cached_hash != rhs.cached_hash)
+		return false;
+	if((lhs.hash_state & rhs.hash_state & dict::unordered_hash_valid) && lhs.cached_unordered_hash != rhs.cached_unordered_hash)
+		return false;
+
+	#ifdef DICT_PARALLEL
+	const std::size_t chunks = details::parallel_chunks(lhs.size());
+	if(chunks > 1)
+	{
+		const std::vector<dict::const_iterator> lhs_bounds = details::partition(lhs.begin(), lhs.size(), chunks);
+		const std::vector<dict::const_iterator> rhs_bounds = details::partition(rhs.begin(), rhs.size(), chunks);
+		const std::vector<char> equal = details::parallel_apply(chunks, [&lhs_bounds, &rhs_bounds](std::size_t c)
+		{
+			return static_cast<char>(std::equal(lhs_bounds[c], lhs_bounds[c + 1], rhs_bounds[c]));
+		});
+		return std::find(equal.begin(), equal.end(), 0) == equal.end();
+	}
+	#endif // DICT_PARALLEL
+	return lhs.sequenced_index() == rhs.sequenced_index();
 }
 
 inline bool operator!=(const dict& lhs, const dict& rhs)
@@ -724,7 +3829,25 @@ inline bool operator!=(const dict& lhs, const dict& rhs)
 
 inline bool operator<(const dict& lhs, const dict& rhs)
 {
-	return lhs.storage < rhs.storage;
+	#ifdef DICT_PARALLEL
+	const std::size_t common = std::min(lhs.size(), rhs.size());
+	const std::size_t chunks = details::parallel_chunks(common);
+	if(chunks > 1)
+	{
+		// each chunk reports -1 (less), 1 (greater) or 0 (equivalent); the first decisive chunk wins
+		const std::vector<dict::const_iterator> lhs_bounds = details::partition(lhs.begin(), common, chunks);
+		const std::vector<dict::const_iterator> rhs_bounds = details::partition(rhs.begin(), common, chunks);
+		const std::vector<int> order = details::parallel_apply(chunks, [&lhs_bounds, &rhs_bounds](std::size_t c)
+		{
+			return details::compare(lhs_bounds[c], lhs_bounds[c + 1], rhs_bounds[c], rhs_bounds[c + 1]);
+		});
+		for(std::size_t c = 0; c < chunks; ++c)
+			if(order[c])
+				return order[c] < 0;
+		return lhs.size() < rhs.size();
+	}
+	#endif // DICT_PARALLEL
+	return details::compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end()) < 0;
 }
 
 inline bool operator<=(const dict& lhs, const dict& rhs)
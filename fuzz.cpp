@@ -0,0 +1,718 @@
+// lexicalunit (c) 2012
+//
+// This code is released under the Artistic License 2.0.
+// http://opensource.org/licenses/artistic-license-2.0
+
+// Randomized stress test that checks dict against a simple reference model.
+//
+// Every input is a byte string decoded into a sequence of operations (add, add_front, erase, relocate, pop_front,
+// pop_back, get, get_recursive, str, save/load, nested edits, update/merge, diff/patch...), which are applied both
+// to a dict and to a model made of a std::vector of keys plus a boost::unordered_map. Any disagreement aborts with
+// a message. Other operations check features against the model on the side: cache mode, freeze() and compact(),
+// the journal, and dictionaries grown past DICT_PARALLEL_THRESHOLD so that the parallel algorithms run.
+//
+// Standalone, it generates random inputs and reports throughput, so it doubles as a soak test:
+//     g++ -O2 fuzz.cpp -o fuzz && ./fuzz [inputs] [seed]
+// With libFuzzer, define DICT_LIBFUZZER to leave out main():
+//     clang++ -g -O1 -fsanitize=fuzzer,address -DDICT_LIBFUZZER fuzz.cpp -o fuzz && ./fuzz
+// Build with -DDICT_ORDERED_INDEX or -DDICT_NO_PARALLEL to exercise the other configurations.
+
+#include "dict.h"
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+
+namespace
+{
+	//! Reference model of a dict: keys in sequence order, and their values.
+	struct model
+	{
+		struct entry
+		{
+			dict::mapped_type value; //!< Value, unless this entry is a sub-dictionary.
+			boost::shared_ptr<model> child; //!< Sub-dictionary, or null.
+		};
+
+		typedef boost::unordered_map<std::string, entry> map_type;
+
+		std::vector<std::string> order;
+		map_type entries;
+
+		void put(const std::string& key, const entry& value, const bool back)
+		{
+			if(!entries.count(key))
+				order.insert(back ? order.end() : order.begin(), key);
+			entries[key] = value;
+		}
+
+		void erase(const std::string& key)
+		{
+			if(entries.erase(key))
+				order.erase(std::find(order.begin(), order.end(), key));
+		}
+
+		// Moves key before position, or to the end if position is not a key.
+		void relocate(const std::string& position, const std::string& key)
+		{
+			if(position == key)
+				return;
+			order.erase(std::find(order.begin(), order.end(), key));
+			order.insert(std::find(order.begin(), order.end(), position), key);
+		}
+
+		// Same as dict::merge(). Sub-models may be shared with copies of this model, so they are copied before merging.
+		void merge(const model& other, const bool keep)
+		{
+			for(std::vector<std::string>::const_iterator k = other.order.begin(), end = other.order.end(); k != end; ++k)
+			{
+				const entry& incoming = other.entries.find(*k)->second;
+				const map_type::iterator i = entries.find(*k);
+				if(i != entries.end() && i->second.child && incoming.child)
+				{
+					boost::shared_ptr<model> child(new model(*i->second.child));
+					child->merge(*incoming.child, keep);
+					i->second.child = child;
+				}
+				else if(i == entries.end() || !keep)
+				{
+					put(*k, incoming, true);
+				}
+			}
+		}
+
+		// Evicts values from the back down to the given capacity, as a cache whose values all weigh 1.
+		void evict(const std::size_t capacity, std::vector<std::string>& evicted)
+		{
+			for(; order.size() > capacity; order.pop_back())
+			{
+				evicted.push_back(order.back());
+				entries.erase(order.back());
+			}
+		}
+	};
+
+	unsigned long long operations = 0;
+
+	void check(const bool condition, const char* what)
+	{
+		if(!condition)
+		{
+			std::fprintf(stderr, "dict disagrees with the model: %s\n", what);
+			std::abort();
+		}
+	}
+
+	//! Decodes bytes from a fuzzer input, yielding zeros once exhausted.
+	class input
+	{
+	public:
+		input(const unsigned char* data, const std::size_t size)
+		: data(data), end(data + size)
+		{
+
+		}
+
+		bool done() const
+		{
+			return data == end;
+		}
+
+		unsigned char byte()
+		{
+			return done() ? 0 : *data++;
+		}
+
+		unsigned bits()
+		{
+			unsigned value = 0;
+			for(int i = 0; i < 4; ++i)
+				value = (value << 8) | byte();
+			return value;
+		}
+
+		int integer()
+		{
+			return static_cast<int>(bits());
+		}
+
+		std::string key()
+		{
+			// mostly a small key space, so that operations often collide, and sometimes a large one
+			if(byte() % 4 == 0)
+				return "w" + boost::lexical_cast<std::string>(bits() % 65536);
+			return "k" + boost::lexical_cast<std::string>(byte() % 16);
+		}
+
+		// Vectors of dicts hold values generated without nesting.
+		dict::mapped_type value(const bool nested = true)
+		{
+			switch(byte() % 12)
+			{
+			case 0:
+				return integer();
+			case 1:
+				return static_cast<float>(integer() % 4096) / 16;
+			case 2:
+				return static_cast<double>(integer()) / 1024;
+			case 3:
+				return static_cast<boost::int64_t>((static_cast<boost::uint64_t>(bits()) << 32) | bits());
+			case 4:
+				return byte() % 2 == 1;
+			case 5:
+				return std::string(byte() % 24, static_cast<char>('a' + byte() % 26));
+			case 6:
+				return std::vector<int>(byte() % 8, integer());
+			case 7:
+				return dict::bytes_type(byte() % 16, byte());
+			case 8:
+				return std::vector<float>(byte() % 8, static_cast<float>(integer() % 4096) / 16);
+			case 9:
+				return std::vector<std::string>(byte() % 4, std::string(byte() % 8, static_cast<char>('a' + byte() % 26)));
+			case 10:
+			{
+				std::vector<bool> v(byte() % 12);
+				for(std::vector<bool>::iterator i = v.begin(), end = v.end(); i != end; ++i)
+					*i = byte() % 2 == 1;
+				return v;
+			}
+			default:
+				return nested ? dict::mapped_type(dicts()) : dict::mapped_type(integer());
+			}
+		}
+
+		std::vector<dict> dicts();
+
+	private:
+		const unsigned char* data;
+		const unsigned char* end;
+	};
+
+	//! Adds a value to a dict as its exact type, with add() or add_front().
+	class add_visitor : public boost::static_visitor<void>
+	{
+	public:
+		add_visitor(dict& d, const std::string& key, const bool back)
+		: d(d), key(key), back(back)
+		{
+
+		}
+
+		template<class T>
+		void operator()(const T& value) const
+		{
+			if(back)
+				d.add(key, value);
+			else
+				d.add_front(key, value);
+		}
+
+	private:
+		dict& d;
+		const std::string& key;
+		const bool back;
+	};
+
+	std::vector<dict> input::dicts()
+	{
+		std::vector<dict> v(byte() % 4);
+		for(std::vector<dict>::iterator i = v.begin(), end = v.end(); i != end; ++i)
+		{
+			for(int n = byte() % 4; n; --n)
+			{
+				const std::string k = key();
+				const dict::mapped_type v = value(false);
+				boost::apply_visitor(add_visitor(*i, k, true), v);
+			}
+		}
+		return v;
+	}
+
+	dict to_dict(const model& m)
+	{
+		std::vector<dict::value_type> values;
+		for(std::vector<std::string>::const_iterator i = m.order.begin(), end = m.order.end(); i != end; ++i)
+		{
+			const model::entry& e = m.entries.find(*i)->second;
+			values.push_back(dict::value_type(*i, e.child ? dict::mapped_type(to_dict(*e.child)) : e.value));
+		}
+		return dict(values.begin(), values.end());
+	}
+
+	// Walks d and m side by side, checking sequence order, keys, values, lookups and sizes.
+	void check_equal(const dict& d, const model& m)
+	{
+		check(d.size() == m.order.size(), "size");
+		check(d.empty() == m.order.empty(), "empty");
+		dict::const_iterator i = d.begin();
+		for(std::vector<std::string>::const_iterator k = m.order.begin(), end = m.order.end(); k != end; ++k, ++i)
+		{
+			check(i != d.end(), "sequence too short");
+			check(i->first == *k, "sequence order");
+			check(d.count(*k) == 1 && d.find(*k) == i, "lookup");
+			const model::entry& e = m.entries.find(*k)->second;
+			if(e.child)
+			{
+				const dict* sub = boost::get<dict>(&i->second);
+				check(sub != 0, "sub-dictionary type");
+				check_equal(*sub, *e.child);
+			}
+			else
+			{
+				check(i->second == e.value, "value");
+			}
+		}
+		check(i == d.end(), "sequence too long");
+	}
+
+	// Checks everything derived from the contents: equality, hashes, str() and size_recursive().
+	void check_all(const dict& d, const model& m)
+	{
+		check_equal(d, m);
+		const dict expected = to_dict(m);
+		check(d == expected && !(d < expected) && !(expected < d), "comparison");
+		check(d.hash() == expected.hash(), "hash");
+		check(d.unordered_hash() == expected.unordered_hash(), "unordered_hash");
+		check(d.str() == expected.str(), "str");
+		check(d.size_recursive() == expected.size_recursive(), "size_recursive");
+	}
+
+	//! Gets a value with get() or get_recursive() as its exact type and compares it with the model.
+	class get_checker : public boost::static_visitor<void>
+	{
+	public:
+		get_checker(const dict& d, const std::string& key, const bool recursive)
+		: d(d), key(key), recursive(recursive)
+		{
+
+		}
+
+		template<class T>
+		void operator()(const T& expected) const
+		{
+			T value;
+			check(recursive ? d.get_recursive(key, value) : d.get(key, value), "get");
+			check(value == expected, "get value");
+		}
+
+	private:
+		const dict& d;
+		const std::string& key;
+		const bool recursive;
+	};
+
+	void check_get(const dict& d, const std::string& key, const model::entry* e, const bool recursive)
+	{
+		if(!e)
+		{
+			int value;
+			check(!(recursive ? d.get_recursive(key, value) : d.get(key, value)), "get of a missing key");
+		}
+		else if(e->child)
+		{
+			dict value;
+			check(recursive ? d.get_recursive(key, value) : d.get(key, value), "get of a sub-dictionary");
+			check_equal(value, *e->child);
+		}
+		else
+		{
+			boost::apply_visitor(get_checker(d, key, recursive), e->value);
+		}
+	}
+
+	//! Records the keys evicted by a cache.
+	class eviction_recorder
+	{
+	public:
+		explicit eviction_recorder(std::vector<std::string>& evicted)
+		: evicted(&evicted)
+		{
+
+		}
+
+		void operator()(const dict::value_type& value) const
+		{
+			evicted->push_back(value.first);
+		}
+
+	private:
+		std::vector<std::string>* evicted;
+	};
+
+	//! Contents of the top level dict as of the last journal check, when its journal is enabled.
+	struct journal_state
+	{
+		bool enabled;
+		const dict* top;
+		dict::size_type version;
+		dict values;
+	} journal;
+
+	// Checks that every value of the top level dict that changed since the last check is covered by the journal.
+	void check_journal()
+	{
+		const dict& d = *journal.top;
+		std::vector<dict::change> changes;
+		if(d.changes_since(journal.version, changes))
+		{
+			bool everything = false;
+			boost::unordered_set<std::string> touched;
+			for(std::vector<dict::change>::size_type n = 0; n < changes.size(); ++n)
+			{
+				const dict::change& c = changes[n];
+				check(c.version == journal.version + n + 1, "journal versions");
+				if(c.kind == dict::change::clear || c.kind == dict::change::reset || c.kind == dict::change::reorder)
+					everything = true;
+				else
+					touched.insert(c.path.substr(0, c.path.find("::")));
+			}
+			check(d.version() == journal.version + changes.size(), "journal version");
+			for(dict::const_iterator i = d.begin(), end = d.end(); i != end && !everything; ++i)
+			{
+				const dict::const_iterator old = journal.values.find(i->first);
+				check(touched.count(i->first) || (old != journal.values.end() && old->second == i->second), "journal missed a change");
+			}
+			for(dict::const_iterator i = journal.values.begin(), end = journal.values.end(); i != end && !everything; ++i)
+				check(touched.count(i->first) || d.count(i->first), "journal missed an erase");
+		}
+		journal.values = d;
+		journal.version = d.version();
+	}
+
+	const std::size_t max_depth = 200;
+
+	// Applies up to the given number of operations decoded from the input to both d and m.
+	void run(input& in, dict& d, model& m, const std::size_t depth, std::size_t count)
+	{
+		for(; count && !in.done(); --count)
+		{
+			++operations;
+			switch(in.byte() % 24)
+			{
+			case 0:
+			case 1:
+			case 2:
+			{
+				const std::string key = in.key();
+				model::entry e;
+				e.value = in.value();
+				const bool back = in.byte() % 2 == 0;
+				boost::apply_visitor(add_visitor(d, key, back), e.value);
+				m.put(key, e, back);
+				break;
+			}
+			case 3:
+			{
+				const std::string key = in.key();
+				check(d.erase(key) == m.entries.count(key), "erase");
+				m.erase(key);
+				break;
+			}
+			case 4:
+			{
+				const std::string position = in.key(), key = in.key();
+				if(!d.count(key))
+					break;
+				d.relocate(d.find(position), d.find(key));
+				m.relocate(position, key);
+				break;
+			}
+			case 5:
+				if(!m.order.empty())
+				{
+					check(d.front().first == m.order.front(), "front");
+					d.pop_front();
+					m.erase(m.order.front());
+				}
+				break;
+			case 6:
+				if(!m.order.empty())
+				{
+					check(d.back().first == m.order.back(), "back");
+					d.pop_back();
+					m.erase(m.order.back());
+				}
+				break;
+			case 7:
+			case 8:
+			{
+				const std::string key = in.key();
+				const model::map_type::const_iterator i = m.entries.find(key);
+				check_get(d, key, i == m.entries.end() ? 0 : &i->second, false);
+				break;
+			}
+			case 9:
+			{
+				// descend through existing sub-dictionaries, then look up a key that may or may not exist
+				std::string path;
+				const model* current = &m;
+				const model::entry* e = 0;
+				for(;;)
+				{
+					// usually an existing key, so that paths get deep
+					const std::size_t nth = in.byte() % 4 ? in.byte() % (current->order.size() + 1) : current->order.size();
+					const std::string key = nth < current->order.size() ? current->order[nth] : in.key();
+					path += key;
+					const model::map_type::const_iterator i = current->entries.find(key);
+					e = i == current->entries.end() ? 0 : &i->second;
+					if(!e || !e->child || in.byte() % 4 == 0)
+						break;
+					current = e->child.get();
+					path += "::";
+				}
+
+				// then maybe into one of the dictionaries of a vector, by index
+				const std::vector<dict>* v = e && !e->child ? boost::get<std::vector<dict> >(&e->value) : 0;
+				model::entry element;
+				if(v && in.byte() % 2 == 0)
+				{
+					const std::size_t index = in.byte() % (v->size() + 1);
+					const dict* sub = index < v->size() ? &(*v)[index] : 0;
+					const std::size_t size = sub ? sub->size() : 0;
+					const std::size_t nth = in.byte() % 4 ? in.byte() % (size + 1) : size;
+					const std::string key = nth < size ? boost::next(sub->begin(), nth)->first : in.key();
+					path += "::" + boost::lexical_cast<std::string>(index) + "::" + key;
+					const dict::const_iterator i = sub ? sub->find(key) : dict::const_iterator();
+					e = 0;
+					if(sub && i != sub->end())
+					{
+						element.value = i->second;
+						e = &element;
+					}
+				}
+				check_get(d, path, e, true);
+				break;
+			}
+			case 10:
+				check_all(d, m);
+				break;
+			case 11:
+			case 12:
+			{
+				// edit a copy of a sub-dictionary, creating it if needed, then store it back in place
+				const std::string key = in.key();
+				const std::size_t ops = in.byte() % 16;
+				if(depth >= max_depth)
+					break;
+				const model::map_type::const_iterator i = m.entries.find(key);
+				boost::shared_ptr<model> child(i != m.entries.end() && i->second.child ? new model(*i->second.child) : new model);
+				dict sub;
+				d.get(key, sub);
+				run(in, sub, *child, depth + 1, ops);
+				d.add(key, sub);
+				model::entry e;
+				e.child = child;
+				m.put(key, e, true);
+				break;
+			}
+			case 13:
+			{
+				std::ostringstream out;
+				d.save(out);
+				std::istringstream saved(out.str());
+				dict loaded;
+				check(loaded.load(saved), "load");
+				check_equal(loaded, m);
+				break;
+			}
+			case 14:
+			{
+				const dict copy(d);
+				check(copy == d && copy.hash() == d.hash(), "copy");
+				if(in.byte() % 8 == 0)
+				{
+					d.clear();
+					m = model();
+				}
+				break;
+			}
+			case 16:
+			{
+				// grow past the parallel threshold, with sub-dictionaries, so that recursive algorithms split their work
+				if(depth > 1 || m.order.size() >= DICT_PARALLEL_THRESHOLD || in.byte() % 4 != 0)
+					break;
+				boost::shared_ptr<model> child(new model);
+				model::entry leaf;
+				leaf.value = 1;
+				child->put("x", leaf, true);
+				dict bulk;
+				for(int n = 0, size = DICT_PARALLEL_THRESHOLD + in.byte(); n < size; ++n)
+				{
+					const std::string key = "g" + boost::lexical_cast<std::string>(n);
+					model::entry e;
+					if(n % 16 == 0)
+					{
+						e.child = child;
+						bulk.add(key, to_dict(*child));
+					}
+					else
+					{
+						e.value = n;
+						bulk.add(key, n);
+					}
+					m.put(key, e, true);
+				}
+				d.update(bulk);
+				check_all(d, m);
+				break;
+			}
+			case 17:
+			{
+				// build another dictionary, then update or merge it in
+				if(depth >= max_depth)
+					break;
+				dict other;
+				model incoming;
+				run(in, other, incoming, depth + 1, in.byte() % 8);
+				switch(in.byte() % 3)
+				{
+				case 0:
+					d.update(other);
+					for(std::vector<std::string>::const_iterator k = incoming.order.begin(), end = incoming.order.end(); k != end; ++k)
+						m.put(*k, incoming.entries.find(*k)->second, true);
+					break;
+				case 1:
+					d.merge(other, dict::merge_keep);
+					m.merge(incoming, true);
+					break;
+				default:
+					d.merge(other);
+					m.merge(incoming, false);
+					break;
+				}
+				break;
+			}
+			case 18:
+			{
+				// change a copy, then carry the changes over with diff() and patch()
+				if(depth >= max_depth)
+					break;
+				dict changed(d);
+				model changed_model(m);
+				run(in, changed, changed_model, depth + 1, in.byte() % 8);
+				d.patch(dict::diff(d, changed));
+				m = changed_model;
+				check_equal(d, m);
+				break;
+			}
+			case 19:
+			{
+				// a copy in cache mode keeps the most recently used values, evicting from the back
+				std::vector<std::string> evicted, expected;
+				const std::size_t capacity = 1 + in.byte() % 16;
+				dict cache(d);
+				cache.set_capacity(capacity, dict::weigher_type(), eviction_recorder(evicted));
+				model cache_model(m);
+				cache_model.evict(capacity, expected);
+				for(std::size_t n = in.byte() % 16; n; --n)
+				{
+					const std::string key = in.key();
+					if(in.byte() % 2 == 0)
+					{
+						model::entry e;
+						e.value = in.value();
+						boost::apply_visitor(add_visitor(cache, key, true), e.value);
+						cache_model.erase(key);
+						cache_model.put(key, e, false);
+						cache_model.evict(capacity, expected);
+					}
+					else
+					{
+						std::string value;
+						const model::map_type::const_iterator i = cache_model.entries.find(key);
+						check(cache.get(key, value) == (i != cache_model.entries.end()), "cache get");
+						if(i != cache_model.entries.end())
+						{
+							const model::entry e = i->second;
+							cache_model.erase(key);
+							cache_model.put(key, e, false);
+						}
+					}
+				}
+				check_equal(cache, cache_model);
+				check(evicted == expected, "evicted values");
+				check(cache.capacity() == capacity && cache.weight() == cache.size(), "cache weight");
+				break;
+			}
+			case 20:
+			{
+				const std::size_t hash = d.hash(), unordered_hash = d.unordered_hash();
+				dict frozen(d);
+				frozen.freeze();
+				check(frozen.frozen() && frozen.size() == m.order.size(), "freeze");
+				check(frozen.hash() == hash && frozen.unordered_hash() == unordered_hash && frozen.frozen(), "frozen hashes");
+				check_equal(frozen, m);
+				check(!frozen.frozen(), "inflate");
+				break;
+			}
+			case 21:
+				// sub-dictionaries accessed by later operations are inflated again
+				d.compact(1 + in.byte() % 32);
+				break;
+			case 22:
+				// also from nested operations, which only change the top level dict once they return
+				if(journal.enabled)
+					check_journal();
+				break;
+			default:
+				check(d.size() == m.order.size(), "size");
+				check(d.str().size() >= 2, "str");
+				break;
+			}
+		}
+	}
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* data, std::size_t size)
+{
+	// even on small machines, so that dictionaries grown past the threshold take the parallel paths
+	dict::parallelism(4);
+
+	input in(data, size);
+	dict d;
+	model m;
+	journal.enabled = in.byte() % 2 == 0;
+	if(journal.enabled)
+	{
+		const dict::size_type capacity = 1 + in.byte() % 64;
+		d.enable_journal(capacity, in.byte() % 2 == 0);
+	}
+	journal.top = &d;
+	journal.version = d.version();
+	journal.values.clear();
+	run(in, d, m, 0, static_cast<std::size_t>(-1));
+	check_all(d, m);
+	if(journal.enabled)
+		check_journal();
+	return 0;
+}
+
+#ifndef DICT_LIBFUZZER
+int main(int argc, char* argv[])
+{
+	const unsigned long inputs = argc > 1 ? std::strtoul(argv[1], 0, 10) : 200;
+	const unsigned seed = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], 0, 10)) : static_cast<unsigned>(std::time(0));
+	std::printf("seed %u, %lu inputs\n", seed, inputs);
+	std::srand(seed);
+
+	std::vector<unsigned char> data;
+	const std::clock_t start = std::clock();
+	for(unsigned long n = 0; n < inputs; ++n)
+	{
+		// some inputs favour nested edits, to build deeply nested dictionaries
+		const int nesting = std::rand() % 4 == 0 ? 2 : 16;
+		data.resize(1024 + std::rand() % 16384);
+		for(std::vector<unsigned char>::iterator i = data.begin(), end = data.end(); i != end; ++i)
+			*i = static_cast<unsigned char>(std::rand() % nesting == 0 ? 11 : std::rand());
+		LLVMFuzzerTestOneInput(&data[0], data.size());
+	}
+
+	const double seconds = static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+	std::printf("%llu operations in %.2f s: %.0f operations/s, %.0f inputs/s\n"
+		, operations, seconds, operations / seconds, inputs / seconds);
+	return 0;
+}
+#endif // DICT_LIBFUZZER
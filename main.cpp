@@ -4,8 +4,39 @@
 // http://opensource.org/licenses/artistic-license-2.0
 
 #include "dict.h"
+#include "shared_dict.h"
+#include <boost/bind.hpp>
+#include <boost/lambda/lambda.hpp>
+#include <boost/unordered_set.hpp>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <limits>
+#include <numeric>
+#include <sstream>
+
+#ifdef DICT_PARALLEL
+#include <thread>
+#endif // DICT_PARALLEL
+
+#ifndef BOOST_WINDOWS
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Ends the process as soon as a value is read into it, to test readers that die in the middle of a read.
+struct exit_on_read
+{
+	exit_on_read()
+	{
+
+	}
+
+	exit_on_read(const int)
+	{
+		::_exit(2);
+	}
+};
+#endif // BOOST_WINDOWS
 
 class int_visitor : public boost::static_visitor<void>
 {
@@ -33,6 +64,20 @@ private:
 	const int check;
 };
 
+void record_eviction(std::vector<std::string>* evicted, const dict::value_type& value)
+{
+	evicted->push_back(value.first);
+}
+
+dict::mapped_type add_ints(const std::string&, const dict::mapped_type& current, const dict::mapped_type& incoming)
+{
+	const int* lhs = boost::get<int>(&current);
+	const int* rhs = boost::get<int>(&incoming);
+	if(lhs && rhs)
+		return *lhs + *rhs;
+	return incoming;
+}
+
 int main()
 {
 	{
@@ -173,9 +218,13 @@ int main()
 		assert(d.get("float", lf)); // got float as double
 		assert(std::abs(lf - 3.14) < std::numeric_limits<float>::epsilon());
 
-		d.add("double", 6.92); // stored double as float
+		d.add("double", 6.92); // stored double natively
 		assert(d.get("double", lf));
-		assert(std::abs(lf - 6.92) < std::numeric_limits<float>::epsilon());
+		assert(lf == 6.92);
+
+		d.add("long double", 6.92L); // stored long double as double
+		assert(d.get("long double", lf));
+		assert(lf == 6.92);
 
 		d.add("string", "literal"); // stored literal as std::string
 		std::string literal;
@@ -183,10 +232,20 @@ int main()
 		assert(literal == "literal");
 
 		long l = 327;
-		d.add("long", l); // stored long as int
+		d.add("long", l); // stored long as int or boost::int64_t, depending on its size
 		long l_out;
 		assert(d.get("long", l_out));
 		assert(l_out == 327);
+
+		const boost::uint32_t u = 4000000000u;
+		d.add("unsigned", u); // stored unsigned int as boost::int64_t
+		boost::int64_t u_out;
+		assert(d.get("unsigned", u_out));
+		assert(u_out == 4000000000LL);
+
+		d.add("short", static_cast<short>(-3)); // stored short as int
+		assert(d.get("short", k));
+		assert(k == -3);
 	}
 
 	{
@@ -255,9 +314,877 @@ int main()
 		assert(d.back().first == "a");
 	}
 
+	{
+		// parallel recursive algorithms match their serial results
+		dict child;
+		child.add("x", 1);
+		child.add("y", "why");
+		std::vector<dict> children(3, child);
+
+		dict big;
+		for(int n = 0; n < 3 * DICT_PARALLEL_THRESHOLD; ++n)
+		{
+			const std::string key = boost::lexical_cast<std::string>(n);
+			if(n % 3 == 0)
+				big.add(key, n);
+			else if(n % 3 == 1)
+				big.add(key, child);
+			else
+				big.add(key, children);
+		}
+
+		const unsigned threads = dict::parallelism();
+		dict::parallelism(4);
+		const dict::size_type size = big.size_recursive();
+		const std::string s = big.str();
+		const dict copy(big);
+		dict less(big);
+		less.add(boost::lexical_cast<std::string>(3 * DICT_PARALLEL_THRESHOLD - 3), -1);
+
+		dict::parallelism(1);
+		assert(size == big.size_recursive());
+		assert(size == DICT_PARALLEL_THRESHOLD * (1 + 3 + 7));
+		assert(s == big.str());
+		assert(copy == big);
+		assert(less < big);
+		assert(!(big < less));
+		assert(big != less);
+		dict::parallelism(4);
+
+		assert(copy == big);
+		assert(less < big);
+		assert(!(big < less));
+		assert(big != less);
+		assert(!(big < copy));
+
+		// large sub-dictionaries are split too, whether their parent is small or large itself
+		dict small, large(big);
+		small.add("a", 1);
+		small.add("big", big);
+		small.add("z", big);
+		large.add("big", big);
+		const dict::size_type small_size = small.size_recursive(), large_size = large.size_recursive();
+		const std::string small_str = small.str(), large_str = large.str();
+		const dict small_copy(small), large_copy(large);
+		dict::parallelism(1);
+		assert(small_size == small.size_recursive() && small_size == 3 + 2 * size);
+		assert(large_size == large.size_recursive() && large_size == 2 * size + 1);
+		assert(small_str == small.str() && large_str == large.str());
+		assert(small_copy == small && large_copy == large);
+		dict::parallelism(threads);
+	}
+
+	{
+		// structural hashing
+		dict a, b, c;
+		a.add("i", 1);
+		a.add("s", "s");
+		b.add("s", "s");
+		b.add("i", 1);
+		c.add("child", a);
+		assert(a.hash() != b.hash());
+		assert(a.unordered_hash() == b.unordered_hash());
+		assert(a != b);
+
+		// cached hashes are kept up to date by mutations
+		const std::size_t before = c.hash();
+		c.add("f", 2.5f);
+		c.add_front("v", std::vector<int>(3, 7));
+		c.add("i", 3);
+		c.erase("i");
+		c.pop_front();
+		c.erase("f");
+		assert(c.hash() == before);
+		c.relocate(c.begin(), c.find("child"));
+		assert(c.hash() == before);
+
+		b.relocate(b.end(), b.begin());
+		assert(a.hash() == b.hash());
+		assert(a == b);
+		const dict fresh(a.begin(), a.end());
+		assert(fresh.hash() == a.hash());
+		assert(fresh.unordered_hash() == a.unordered_hash());
+
+		boost::unordered_set<dict> seen;
+		seen.insert(a);
+		seen.insert(b);
+		seen.insert(c);
+		assert(seen.size() == 2);
+		assert(seen.count(fresh));
+	}
+
+	{
+		// recursive queries
+		dict alice, bob, settings;
+		alice.add("name", "alice");
+		alice.add("score", 3);
+		bob.add("name", "bob");
+		bob.add("score", 5);
+		bob.add("scorecard", "full");
+		std::vector<dict> users;
+		users.push_back(alice);
+		users.push_back(bob);
+		settings.add("score", 1);
+		settings.add("long_sub_key", 2);
+
+		dict d;
+		d.add("users", users);
+		d.add("settings", settings);
+		d.add("score", 0);
+
+		std::vector<std::string> paths;
+		std::vector<int> scores;
+		const dict::recursive_range range = d.find_recursive("users::*::score");
+		for(dict::recursive_const_iterator i = range.begin(), end = range.end(); i != end; ++i)
+		{
+			paths.push_back(i.path());
+			scores.push_back(boost::get<int>(i->second));
+		}
+		assert(paths.size() == 2);
+		assert(paths[0] == "users::0::score");
+		assert(paths[1] == "users::1::score");
+		assert(scores[0] == 3 && scores[1] == 5);
+
+		assert(d.count_recursive("*::*::score*") == 3);
+		assert(d.count_recursive("*::score") == 1);
+		assert(d.count_recursive("users::1::*") == 3);
+		assert(d.count_recursive("users::2::*") == 0);
+		assert(d.count_recursive("users::*") == 0); // the dictionaries of a vector aren't values themselves
+		assert(d.count_recursive("score") == 1);
+
+		int i;
+		assert(d.get_recursive("users::1::score", i));
+		assert(i == 5);
+		assert(d.get_recursive("settings::long_sub_key", i));
+		assert(i == 2);
+		assert(!d.get_recursive("users::2::score", i));
+		assert(!d.get_recursive("users::x::score", i));
+		dict user;
+		assert(d.get_recursive("users::0", user));
+		assert(user == alice);
+
+		assert(d.find_if(boost::bind(&dict::value_type::first, _1) == "settings") == d.find("settings"));
+
+		// visits every value in depth-first order
+		const dict::recursive_range all = d.find_recursive_if(boost::lambda::constant(true));
+		assert(std::distance(all.begin(), all.end()) == 10);
+
+		const std::size_t before = d.hash();
+		assert(d.erase_recursive("users::*::score") == 2);
+		assert(d.hash() != before);
+		assert(d.count_recursive("users::*::score") == 0);
+		assert(d.count_recursive("users::*::name") == 2);
+		assert(d.get_recursive("settings::score", i));
+
+		assert(d.erase_recursive_if(boost::bind(&dict::value_type::first, _2) == "name") == 2);
+		assert(d.size_recursive() == 6);
+		assert(d.erase_if(boost::bind(&dict::value_type::first, _1) != "score") == 2);
+		assert(d.size() == 1);
+	}
+
+	{
+		// diff and patch
+		dict inner, a;
+		inner.add("x", 1);
+		inner.add("y", 2);
+		a.add("keep", "same");
+		a.add("inner", inner);
+		a.add("gone", 1);
+		a.add("changed", 1.5f);
+		a.add("retyped", 1);
+
+		dict b(a);
+		inner.add("x", 10);
+		inner.erase("y");
+		inner.add("z", 3);
+		b.add("inner", inner);
+		b.erase("gone");
+		b.add("changed", 2.5f);
+		b.add("retyped", "one");
+		b.add("new", std::vector<int>(2, 4));
+
+		assert(dict::diff(a, a).empty());
+		const dict changes = dict::diff(a, b);
+		assert(changes.size() == 4);
+		assert(changes.get("nested").get("inner").size() == 3);
+		assert(!changes.count("order"));
+
+		dict c(a);
+		c.patch(changes);
+		assert(c == b);
+		assert(c.str() == b.str());
+
+		// reordering is recorded and replayed
+		b.relocate(b.begin(), b.find("new"));
+		c = a;
+		c.patch(dict::diff(a, b));
+		assert(c == b);
+		assert(dict::diff(b, c).empty());
+	}
+
+	{
+		// change journal
+		dict d, child;
+		child.add("x", 1);
+		d.add("a", 1);
+		assert(d.version() == 0);
+		std::vector<dict::change> changes;
+		assert(!d.changes_since(0, changes));
+
+		d.enable_journal(8);
+		d.add("child", child);
+		d.add("a", 2);
+		d.add_front("b", 3);
+		d.relocate(d.end(), d.begin());
+		d.pop_back();
+		d.erase("a");
+		assert(d.version() == 6);
+		assert(d.changes_since(0, changes));
+		assert(changes.size() == 6);
+		assert(changes[0].kind == dict::change::add && changes[0].path == "child");
+		assert(changes[1].kind == dict::change::replace && changes[1].path == "a");
+		assert(changes[3].kind == dict::change::relocate && changes[3].path == "b");
+		assert(changes[4].kind == dict::change::pop_back && changes[4].path == "b");
+		assert(changes[5].version == 6);
+
+		// in-place changes to sub-dictionaries are recorded with their full paths
+		child.add("y", 2);
+		dict target(d);
+		target.add("child", child);
+		d.patch(dict::diff(d, target));
+		assert(d.erase_recursive("child::x") == 1);
+		changes.clear();
+		assert(d.changes_since(6, changes));
+		assert(changes.size() == 2);
+		assert(changes[0].kind == dict::change::add && changes[0].path == "child::y");
+		assert(changes[1].kind == dict::change::erase && changes[1].path == "child::x");
+
+		// old versions fall out of the ring buffer
+		for(int n = 0; n < 8; ++n)
+			d.add("n", n);
+		assert(!d.changes_since(6, changes));
+		changes.clear();
+		assert(d.changes_since(d.version() - 2, changes) && changes.size() == 2);
+
+		// copies don't carry the journal
+		dict copy(d);
+		assert(copy.version() == 0);
+		copy.add("z", 1);
+		d = copy;
+		changes.clear();
+		assert(d.changes_since(d.version() - 1, changes));
+		assert(changes[0].kind == dict::change::reset);
+		d.disable_journal();
+		assert(d.version() == 0);
+	}
+
+	{
+		// sorting and key ranges
+		dict d;
+		d.add("metric.mem.used", 3);
+		d.add("metric.cpu.user", 1);
+		d.add("name", "host");
+		d.add("metric.cpu.system", 2);
+		d.add("metric.cpuid", 4);
+
+		d.sort();
+		std::string keys;
+		for(dict::const_iterator i = d.begin(), end = d.end(); i != end; ++i)
+			keys += i->first + " ";
+		assert(keys == "metric.cpu.system metric.cpu.user metric.cpuid metric.mem.used name ");
+
+		#ifdef DICT_ORDERED_INDEX
+		d.add_front("metric.cpu.idle", 0);
+		dict::key_range_type range = d.prefix_range("metric.cpu.");
+		assert(std::distance(range.first, range.second) == 3);
+		assert(range.first->first == "metric.cpu.idle");
+		range = d.key_range("metric.cpu", "metric.mem");
+		assert(std::distance(range.first, range.second) == 4);
+		range = d.key_range("metric.mem", "metric.cpu"); // reversed bounds give an empty range
+		assert(range.first == range.second && range.first->first == "metric.mem.used");
+		assert(d.lower_bound("n")->first == "name");
+		assert(d.upper_bound("name") == d.key_end());
+		assert(d.equal_range("name").first->first == "name");
+		assert(d.prefix_range("x").first == d.prefix_range("x").second);
+		assert(d.begin()->first == "metric.cpu.idle");
+		d.sort();
+		assert(d.begin()->first == "metric.cpu.idle");
+		assert(d.back().first == "name");
+		#endif // DICT_ORDERED_INDEX
+	}
+
+	{
+		// bounded LRU cache mode
+		std::vector<std::string> evicted;
+		dict cache;
+		cache.set_capacity(3, dict::weigher_type(), boost::bind(record_eviction, &evicted, _1));
+		cache.add("a", 1);
+		cache.add("b", 2);
+		cache.add("c", 3);
+		int i;
+		assert(cache.get("a", i) && i == 1); // promotes a
+		cache.add("d", 4); // evicts b
+		assert(cache.size() == 3);
+		assert(evicted.size() == 1 && evicted[0] == "b");
+		assert(!cache.count("b"));
+		assert(cache.front().first == "d");
+		assert(cache.back().first == "c");
+
+		const dict& view = cache;
+		assert(view.get("c", i)); // const access does not promote
+		assert(cache.back().first == "c");
+
+		cache.set_capacity(2);
+		assert(cache.size() == 2);
+		assert(!cache.count("c"));
+
+		// weighting by memory size
+		dict sized;
+		sized.set_capacity(4096, dict::memory_weight);
+		sized.add("small", 1);
+		sized.add("big", std::string(2048, 'x'));
+		assert(sized.weight() > 2048 && sized.weight() <= 4096);
+		sized.add("bigger", std::string(3072, 'y'));
+		assert(sized.size() == 1 && sized.count("bigger"));
+		sized.erase("bigger");
+		assert(sized.weight() == 0);
+
+		dict plain(cache);
+		assert(plain.capacity() == 2);
+		plain.set_capacity(0);
+		plain.add("e", 5);
+		assert(plain.size() == 3 && plain.weight() == 0);
+
+		// a journaled cache records new keys and evictions, but touches only on request
+		dict logged;
+		logged.set_capacity(2);
+		logged.enable_journal();
+		logged.add("a", 1);
+		logged.add("b", 2);
+		assert(logged.get("a", i) && logged.front().first == "a");
+		logged.add("a", 3);
+		std::vector<dict::change> changes;
+		assert(logged.changes_since(0, changes) && changes.size() == 3);
+		assert(changes[0].kind == dict::change::add && changes[1].kind == dict::change::add);
+		assert(changes[2].kind == dict::change::replace);
+		logged.enable_journal(16, true);
+		assert(logged.get("b", i));
+		logged.add("c", 4); // evicts a
+		changes.clear();
+		assert(logged.changes_since(0, changes) && changes.size() == 3);
+		assert(changes[0].kind == dict::change::relocate && changes[0].path == "b");
+		assert(changes[1].kind == dict::change::add && changes[2].kind == dict::change::pop_back);
+		assert(logged.front().first == "c" && logged.back().first == "b");
+	}
+
+	{
+		// binary save and load
+		dict d, child;
+		child.add("b", std::vector<bool>(3, true));
+		child.add("v", std::vector<std::string>(2, "s"));
+		d.add("i", 1);
+		d.add("f", 2.5f);
+		d.add("s", std::string("with\0nul", 8));
+		d.add("vi", std::vector<int>(1000, 7));
+		d.add("vf", std::vector<float>());
+		d.add("child", child);
+		d.add("children", std::vector<dict>(2, child));
+
+		std::stringstream stream;
+		d.save(stream);
+		const std::string bytes = stream.str();
+		dict loaded;
+		loaded.add("old", 1);
+		assert(loaded.load(stream));
+		assert(loaded == d);
+		assert(loaded.str() == d.str());
+
+		// truncated or corrupt input fails and leaves the dictionary alone
+		for(std::string::size_type n = 0; n < bytes.size(); n += 97)
+		{
+			std::istringstream truncated(bytes.substr(0, n));
+			assert(!loaded.load(truncated));
+			assert(loaded == d);
+		}
+		std::string corrupt = bytes;
+		corrupt[5] = '\xff';
+		std::istringstream corrupted(corrupt);
+		assert(!loaded.load(corrupted));
+
+		// loading keeps the cache mode and the journal, and evicts down to the capacity
+		dict bounded;
+		bounded.set_capacity(3);
+		bounded.enable_journal();
+		std::istringstream reloaded(bytes);
+		assert(bounded.load(reloaded));
+		assert(bounded.capacity() == 3 && bounded.size() == 3 && bounded.weight() == 3);
+		std::vector<dict::change> reload_changes;
+		assert(bounded.changes_since(0, reload_changes) && reload_changes.size() == 1 + d.size() - 3);
+		assert(reload_changes[0].kind == dict::change::reset && reload_changes[1].kind == dict::change::pop_back);
+		assert(bounded.front().first == "i" && bounded.back().first == "s");
+
+		#ifdef DICT_ASYNC
+		// asynchronous save and load
+		const std::string path = "dict_test.bin";
+		std::future<bool> saved = dict::save_async(d, path);
+		d.add("i", 2); // the snapshot is unaffected
+		assert(saved.get());
+		dict from_file = dict::load_async(path).get();
+		assert(from_file != d);
+		d.add("i", 1);
+		assert(from_file == d);
+
+		// a shared immutable dictionary is saved without copying it
+		const boost::shared_ptr<const dict> published(new dict(d));
+		assert(dict::save_async(published, path).get());
+		assert(dict::load_async(path).get() == *published);
+		std::remove(path.c_str());
+
+		bool threw = false;
+		try
+		{
+			dict::load_async(path).get();
+		}
+		catch(const std::ios_base::failure&)
+		{
+			threw = true;
+		}
+		assert(threw);
+		#endif // DICT_ASYNC
+	}
+
+	{
+		// compressed cold sub-dictionaries
+		dict user;
+		user.add("name", std::string(100, 'n'));
+		user.add("scores", std::vector<int>(100, 9));
+		dict users;
+		for(int n = 0; n < 50; ++n)
+			users.add(boost::lexical_cast<std::string>(n), user);
+
+		dict root;
+		root.add("users", users);
+		root.add("list", std::vector<dict>(2, users));
+		const dict original(root);
+		const std::size_t hash = root.hash();
+
+		dict frozen(users);
+		frozen.freeze();
+		assert(frozen.frozen());
+		assert(frozen.size() == 50);
+		assert(frozen.hash() == users.hash());
+		assert(frozen.size_recursive() == users.size_recursive() && frozen.frozen());
+		const dict copy(frozen); // copies the compressed form
+		assert(copy.frozen());
+		assert(frozen.frozen());
+		std::vector<int> scores;
+		assert(copy.get_recursive("7::scores", scores) && scores.size() == 100);
+		assert(!copy.frozen());
+		assert(copy == users);
+		std::ostringstream saved; // written straight from the compressed form
+		frozen.save(saved);
+		assert(frozen.frozen());
+		std::ostringstream expected;
+		users.save(expected);
+		assert(saved.str() == expected.str());
+		frozen.add("extra", 1);
+		assert(!frozen.frozen());
+		assert(frozen.size() == 51);
+
+		// candidates are frozen by a later compact() unless used in between
+		assert(root.compact(100) == 0);
+		assert(root.compact(100) == 3);
+		assert(root.hash() == hash);
+		assert(root.get_recursive("list::1::49::scores", scores) && scores[99] == 9);
+		assert(root.compact(100) == 0);
+		assert(root.compact(100) == 1);
+		assert(root == original);
+		assert(root.str() == original.str());
+		assert(root.compact(100) == 0);
+		assert(root.compact(100) == 3);
+
+		#ifdef DICT_PARALLEL
+		// readers of a const dict inflate frozen sub-dictionaries safely, and copies see all of it
+		{
+			const dict& shared = root;
+			std::vector<int> found(4, 0);
+			std::vector<std::thread> readers;
+			for(int t = 0; t < 4; ++t)
+				readers.push_back(std::thread([&shared, &original, &found, t]
+				{
+					std::vector<int> s;
+					const dict copy(shared);
+					found[t] = shared.get_recursive("users::7::scores", s) && s.size() == 100 && copy == original;
+				}));
+			for(std::vector<std::thread>::iterator i = readers.begin(), end = readers.end(); i != end; ++i)
+				i->join();
+			assert(std::accumulate(found.begin(), found.end(), 0) == 4);
+		}
+		#endif // DICT_PARALLEL
+
+		// the codec round trips repetitive and incompressible data, and rejects corrupt input
+		std::string data;
+		for(int n = 0; n < 5000; ++n)
+			data += static_cast<char>(n % 7 == 0 ? std::rand() : n % 251);
+		std::vector<char> compressed;
+		details::lz_compress(data.data(), data.size(), compressed);
+		assert(compressed.size() < data.size());
+		std::string inflated;
+		assert(details::lz_decompress(compressed, data.size(), inflated) && inflated == data);
+		assert(!details::lz_decompress(compressed, data.size() + 1, inflated));
+		compressed.resize(compressed.size() / 2);
+		assert(!details::lz_decompress(compressed, data.size(), inflated));
+	}
+
+	{
+		// update() and recursive merge()
+		dict a;
+		a.add("x", 1);
+		a.add("y", 2);
+		dict b;
+		b.add("z", 3);
+		b.add("x", 4);
+		dict updated(a);
+		updated.update(b);
+		assert(updated.str() == "{'x': 4, 'y': 2, 'z': 3}");
+		updated.update(updated);
+		assert(updated.str() == "{'x': 4, 'y': 2, 'z': 3}");
+		dict empty;
+		empty.update(b);
+		assert(empty == b && empty.hash() == b.hash());
+
+		#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+		dict moved(a), source(b);
+		moved.update(std::move(source));
+		assert(moved == updated);
+		assert(source.empty() && source == dict());
+		moved.enable_journal();
+		source.add("w", 5);
+		moved.update(std::move(source));
+		assert(moved.str() == "{'x': 4, 'y': 2, 'z': 3, 'w': 5}" && source.empty());
+		assert(moved.version() == 1);
+		#endif // BOOST_NO_CXX11_RVALUE_REFERENCES
+
+		dict stats;
+		stats.add("hits", 1);
+		stats.add("name", "old");
+		a.add("stats", stats);
+		a.add("list", std::vector<dict>(1, stats));
+		stats.add("hits", 10);
+		stats.add("name", "new");
+		stats.add("extra", 1.5f);
+		b.add("stats", stats);
+		b.add("list", std::vector<dict>(2, stats));
+
+		dict merged(a);
+		merged.enable_journal();
+		merged.merge(b);
+		assert(merged.str() == "{'x': 4, 'y': 2, 'stats': {'hits': 10, 'name': new, 'extra': 1.5}, 'list': [{'hits': 10, 'name': new, 'extra': 1.5}, {'hits': 10, 'name': new, 'extra': 1.5}], 'z': 3}");
+		std::vector<dict::change> changes;
+		assert(merged.changes_since(0, changes));
+		assert(changes.size() == 6 && changes[2].path == "stats::hits");
+		merged.disable_journal();
+		assert(merged.hash() == dict(merged).hash());
+
+		merged = a;
+		merged.merge(b, dict::merge_keep);
+		assert(merged.str() == "{'x': 1, 'y': 2, 'stats': {'hits': 1, 'name': old, 'extra': 1.5}, 'list': [{'hits': 1, 'name': old}], 'z': 3}");
+
+		merged = a;
+		merged.merge(b, add_ints);
+		int hits;
+		assert(merged.get_recursive("stats::hits", hits) && hits == 11);
+		assert(merged.get("x", hits) && hits == 5);
+	}
+
+	{
+		// batch get
+		dict d;
+		d.add("id", 42);
+		d.add("name", "bob");
+		d.add("score", 1.5f);
+		d.add("tags", std::vector<std::string>(2, "x"));
+		int id = 0;
+		std::string name, score, missing;
+		float ratio = 0;
+		std::vector<std::string> tags;
+		dict::batch fields;
+		fields.add("id", id).add("name", name).add("score", score).add("missing", missing).add("name", ratio).add("tags", tags);
+		assert(fields.size() == 6);
+		assert(d.get(fields) == 4);
+		assert(id == 42 && name == "bob" && score == "1.5" && tags.size() == 2);
+		assert(fields.found(0) && !fields.found(3) && !fields.found(4));
+
+		dict other;
+		other.add("missing", "here");
+		assert(other.get(fields) == 1 && fields.found(3) && missing == "here");
+
+		dict cache;
+		cache.set_capacity(10);
+		cache.add("name", "bob");
+		cache.add("id", 7);
+		assert(cache.get(fields) == 2 && id == 7);
+		assert(cache.front().first == "name");
+		fields.clear();
+		assert(d.get(fields) == 0);
+	}
+
+	{
+		// 64-bit integers, doubles, bools and bytes
+		dict d;
+		const boost::int64_t id = 9007199254740993LL; // not representable as a double
+		d.add("id", id);
+		d.add("pi", 3.141592653589793);
+		d.add("yes", true);
+		d.add("name", "literal");
+		dict::bytes_type blob;
+		blob.push_back('a');
+		blob.push_back(0);
+		blob.push_back(0xff);
+		blob.push_back('\'');
+		d.add("blob", blob);
+
+		boost::int64_t id_out = 0;
+		double pi = 0;
+		bool yes = false;
+		std::string name;
+		dict::bytes_type blob_out;
+		assert(d.get("id", id_out) && id_out == id);
+		assert(d.get("pi", pi) && pi == 3.141592653589793);
+		assert(d.get("yes", yes) && yes);
+		assert(d.get("name", name) && name == "literal"); // not converted to bool
+		assert(d.get("blob", blob_out) && blob_out == blob);
+		assert(!d.get("name", yes));
+		assert(d.str() == "{'id': 9007199254740993, 'pi': 3.1415926535897931, 'yes': 1, 'name': literal, 'blob': b'a\\x00\\xff\\x27'}");
+
+		// only bool itself is stored as bool: pointers and wide strings would merely convert to it
+		assert(!dict_implicitly_supports<int*>::value && !dict_implicitly_supports<const wchar_t*>::value);
+		assert(dict_implicitly_supports<unsigned long long>::value && dict_implicitly_supports<char>::value);
+
+		// unsigned 64-bit values above the range of boost::int64_t wrap around, but read back unchanged
+		const boost::uint64_t big = std::numeric_limits<boost::uint64_t>::max();
+		boost::uint64_t big_out = 0;
+		d.add("big", big);
+		assert(d.get("big", big_out) && big_out == big);
+		assert(d.get("big", id_out) && id_out == -1);
+		d.erase("big");
+
+		std::ostringstream out;
+		d.save(out);
+		std::istringstream in(out.str());
+		dict loaded;
+		assert(loaded.load(in) && loaded == d && loaded.hash() == d.hash());
+		std::string corrupt = out.str();
+		corrupt[corrupt.find("yes") + 4] = 2; // bools are stored as 0 or 1
+		std::istringstream corrupted(corrupt);
+		assert(!loaded.load(corrupted));
+	}
+
+	{
+		// comparing deeply nested dictionaries takes linear time
+		dict a, b;
+		for(int depth = 0; depth < 64; ++depth)
+		{
+			dict parent;
+			parent.add("child", a);
+			a.swap(parent);
+		}
+		b = a;
+		assert(!(a < b) && !(b < a) && a <= b);
+		b.add("extra", 1);
+		assert(a < b);
+	}
+
+	{
+		// lazy views
+		dict d;
+		d.add("a", 1);
+		d.add("b", "two");
+		d.add("c", 3);
+		d.add("d", dict());
+		const dict::keys_view keys = d.keys();
+		assert(std::vector<std::string>(keys.begin(), keys.end()).size() == 4);
+		assert(*keys.begin() == "a" && &*keys.begin() == &d.begin()->first);
+		assert(boost::size(d.values()) == 4 && *boost::next(d.values().begin()) == dict::mapped_type(std::string("two")));
+		assert(boost::size(d.items()) == 4 && d.items().front().first == "a");
+
+		const dict::values_as_view<int>::type ints = d.values_as<int>();
+		assert(std::accumulate(ints.begin(), ints.end(), 0) == 4);
+		assert(std::count(ints.begin(), ints.end(), 3) == 1);
+		assert(boost::size(d.values_as<float>()) == 0);
+		assert(boost::size(d.items_of<dict>()) == 1 && d.items_of<dict>().front().first == "d");
+		assert(d.values_as<std::string>().front() == "two");
+
+		std::string joined;
+		for(dict::keys_view::iterator i = keys.begin(), end = keys.end(); i != end; ++i)
+			joined += *i;
+		assert(joined == "abcd");
+	}
+
+	{
+		// dictionaries in shared memory
+		const char* name = "dict_test_segment";
+		shared_dict::remove(name);
+		{
+			shared_dict writer(boost::interprocess::open_or_create, name, 1 << 20);
+			const shared_dict reader(boost::interprocess::open_only, name); // typically in another process
+			assert(reader.empty() && reader.begin() == reader.end());
+
+			dict child;
+			child.add("x", 7);
+			child.add("name", "child");
+			dict d;
+			d.add("a", 1);
+			d.add("child", child);
+			d.add("list", std::vector<dict>(2, child));
+			d.add("id", boost::int64_t(1) << 40);
+			assert(writer.publish(d));
+			assert(reader.size() == 4 && reader.count("child") && !reader.count("missing"));
+			assert(reader.snapshot() == d && reader.str() == d.str());
+
+			int i = 0;
+			std::string s, name;
+			assert(reader.get("a", i) && i == 1);
+			assert(reader.get("a", s) && s == "1");
+			assert(reader.get_recursive("child::x", i) && i == 7);
+			assert(reader.get_recursive("list::1::name", name) && name == "child");
+			assert(!reader.get_recursive("list::2::name", s));
+			assert(!reader.get_recursive("a::x", i));
+			assert(reader.get("child") == child);
+			dict list_entry;
+			assert(reader.get_recursive("list::0", list_entry) && list_entry == child);
+
+			std::vector<std::string> keys;
+			for(shared_dict::const_iterator it = reader.begin(), end = reader.end(); it != end; ++it)
+				keys.push_back(it->first);
+			assert(keys.size() == 4 && keys[1] == "child" && keys[3] == "id");
+
+			const shared_dict::size_type version = reader.version();
+			assert(writer.add("a", 2.5) && writer.add("b", child));
+			s.clear();
+			assert(reader.get("a", s) && s == "2.5");
+			assert(reader.get_recursive("b::x", i) && i == 7);
+			assert(writer.erase("child") == 1 && writer.erase("child") == 0);
+			assert(reader.size() == 4 && reader.version() == version + 3);
+			name.clear();
+			assert(reader.get_recursive("list::01::name", name) && name == "child");
+
+			// iterators hold nothing between steps, so the loop body may read and write
+			keys.clear();
+			for(shared_dict::const_iterator it = reader.begin(), end = reader.end(); it != end; ++it)
+			{
+				keys.push_back(it->first);
+				assert(reader.count(it->first) && reader.size() >= 4);
+				if(it->first == "a")
+					assert(writer.add("c", 3));
+			}
+			assert(keys.size() == 5 && keys[0] == "a" && keys[4] == "c");
+
+			// erasing the current value and the next one skips to the value after them
+			keys.clear();
+			for(shared_dict::const_iterator it = reader.begin(), end = reader.end(); it != end; ++it)
+			{
+				keys.push_back(it->first);
+				if(it->first == "list")
+					assert(writer.erase("list") && writer.erase("id"));
+			}
+			assert(keys.size() == 4 && keys[1] == "list" && keys[2] == "b" && keys[3] == "c" && reader.size() == 3);
+
+			// a value erased and added again moves to the end, where it is visited again
+			keys.clear();
+			for(shared_dict::const_iterator it = reader.begin(), end = reader.end(); it != end; ++it)
+			{
+				keys.push_back(it->first);
+				if(keys.size() == 1)
+					assert(writer.erase("a") && writer.add("a", 4));
+			}
+			assert(keys.size() == 4 && keys[0] == "a" && keys[1] == "b" && keys[3] == "a");
+
+			// replaced versions are freed, so repeated writes don't exhaust the segment
+			for(int n = 0; n < 1000; ++n)
+				assert(writer.add("blob", dict::bytes_type(4096)));
+			assert(reader.size() == 4);
+
+			dict huge;
+			huge.add("blob", dict::bytes_type(2 << 20)); // larger than the segment
+			assert(!writer.publish(huge) && !writer.add("blob", dict::bytes_type(2 << 20)));
+			assert(reader.size() == 4);
+			writer.clear();
+			assert(reader.empty());
+		}
+		shared_dict::remove(name);
+	}
+
+	#ifndef BOOST_WINDOWS
+	{
+		// one writer and several reader processes, one of which dies while reading
+		const char* name = "dict_test_processes";
+		shared_dict::remove(name);
+		{
+			shared_dict writer(boost::interprocess::open_or_create, name, 1 << 20);
+			dict d;
+			d.add("a", 0);
+			d.add("b", 0);
+			d.add("c", 0);
+			assert(writer.publish(d));
+
+			std::vector<pid_t> readers;
+			for(int n = 0; n < 3; ++n)
+			{
+				const pid_t pid = ::fork();
+				assert(pid >= 0);
+				if(pid == 0)
+				{
+					// every version holds the same number under all keys, and numbers only grow
+					const shared_dict reader(boost::interprocess::open_only, name);
+					for(int last = 0; !reader.count("stop"); )
+					{
+						const dict snapshot = reader.snapshot();
+						int a = -1, b = -1, c = -1;
+						if(!snapshot.get("a", a) || !snapshot.get("b", b) || !snapshot.get("c", c) || a != b || b != c || a < last)
+							::_exit(1);
+						last = a;
+					}
+					::_exit(0);
+				}
+				readers.push_back(pid);
+			}
+
+			const pid_t dying = ::fork();
+			assert(dying >= 0);
+			if(dying == 0)
+			{
+				const shared_dict reader(boost::interprocess::open_only, name);
+				exit_on_read value;
+				reader.get("a", value); // exits holding a reader slot
+				::_exit(1);
+			}
+			int status = 0;
+			assert(::waitpid(dying, &status, 0) == dying && WIFEXITED(status) && WEXITSTATUS(status) == 2);
+
+			// writers free the slot of the dead reader instead of waiting on it forever
+			::alarm(60);
+			for(int version = 1; version <= 200; ++version)
+			{
+				d.clear();
+				d.add("a", version);
+				d.add("b", version);
+				d.add("c", version);
+				assert(writer.publish(d));
+			}
+			assert(writer.add("stop", true));
+			for(std::vector<pid_t>::const_iterator i = readers.begin(), end = readers.end(); i != end; ++i)
+				assert(::waitpid(*i, &status, 0) == *i && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			::alarm(0);
+		}
+		shared_dict::remove(name);
+	}
+	#endif // BOOST_WINDOWS
+
 	{
 		// compile errors
 		// dict d;
 		// d.add("foo", (int*)0); // no matching member function for type int*
+		// d.add("foo", L"wide"); // no matching member function for type const wchar_t[5]
 	}
 }
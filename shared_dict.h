@@ -0,0 +1,809 @@
+// lexicalunit (c) 2012
+//
+// This code is released under the Artistic License 2.0.
+// http://opensource.org/licenses/artistic-license-2.0
+
+#ifndef LEXICALUNIT_SHARED_DICT_H
+#define LEXICALUNIT_SHARED_DICT_H
+
+#include "dict.h"
+#include <boost/atomic/ipc_atomic.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/exceptions.hpp>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/interprocess/sync/interprocess_mutex.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <streambuf>
+
+#ifndef BOOST_WINDOWS
+#include <cerrno>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#include <thread>
+#endif // BOOST_WINDOWS
+
+namespace details
+{
+	// Input buffer reading directly from memory, such as a value stored in shared memory.
+	class memory_buffer : public std::streambuf
+	{
+	public:
+		memory_buffer(const char* data, const std::size_t size)
+		{
+			char* begin = const_cast<char*>(data);
+			setg(begin, begin, begin + size);
+		}
+	};
+
+	inline boost::uint32_t current_process()
+	{
+		#ifndef BOOST_WINDOWS
+		return static_cast<boost::uint32_t>(::getpid());
+		#else
+		return static_cast<boost::uint32_t>(::_getpid());
+		#endif // BOOST_WINDOWS
+	}
+
+	// False if the given process has certainly exited. Without a way to tell, processes are assumed to be alive.
+	inline bool process_alive(const boost::uint32_t pid)
+	{
+		#ifndef BOOST_WINDOWS
+		return ::kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+		#else
+		return pid != 0;
+		#endif // BOOST_WINDOWS
+	}
+
+	// Lets other threads run while waiting on a reader in another process.
+	inline void yield_thread()
+	{
+		#ifndef BOOST_WINDOWS
+		::sched_yield();
+		#else
+		std::this_thread::yield();
+		#endif // BOOST_WINDOWS
+	}
+} // namespace details
+
+//! A dictionary stored in a named shared memory segment, so that many processes can share a single copy.
+//! Any process may publish a dict into the segment or add and erase its values, while others read it concurrently.
+//! Readers never lock: every change builds a new version of the top level table, sharing unchanged sub-dictionaries,
+//! and swaps it in atomically. Old versions are freed once no reader can still be using them, skipping readers whose
+//! process has exited. Writers serialize on a mutex, so a writer that dies mid-change blocks later writers.
+//! Sub-dictionaries, including the dictionaries of a std::vector<dict>, are stored as nested tables, so get_recursive()
+//! walks them without copying. Other values are stored in the binary format of dict::save() and converted when read.
+class shared_dict
+{
+public:
+	typedef dict::key_type key_type; //!< Lookup type for this dictionary.
+	typedef dict::mapped_type mapped_type; //!< Types that can be stored in this dictionary.
+	typedef dict::value_type value_type; //!< Value type yielded by iterators, by value.
+	typedef dict::size_type size_type; //!< Unsigned integral type.
+	class const_iterator; //!< Sequential iterator, ordered by insertion. Holds no lock.
+
+private:
+	typedef boost::interprocess::managed_shared_memory segment_type;
+	typedef segment_type::segment_manager segment_manager;
+	typedef segment_type::handle_t handle_type;
+	typedef boost::interprocess::allocator<char, segment_manager> char_allocator;
+	typedef boost::interprocess::basic_string<char, std::char_traits<char>, char_allocator> string_type;
+	typedef boost::interprocess::vector<char, char_allocator> payload_type;
+	typedef boost::interprocess::interprocess_mutex mutex_type;
+	typedef boost::interprocess::scoped_lock<mutex_type> write_lock;
+
+	struct table;
+
+	struct entry
+	{
+		entry(const key_type& key, const char_allocator& allocator)
+		: key(key.begin(), key.end(), allocator)
+		, which(0)
+		, payload(allocator)
+		, order(0)
+		{
+
+		}
+
+		// spelled out, since the implicit one takes a non-const reference under C++03 move emulation
+		entry& operator=(const entry& other)
+		{
+			key = other.key;
+			which = other.which;
+			payload = other.payload;
+			child = other.child;
+			order = other.order;
+			return *this;
+		}
+
+		string_type key;
+		int which; // mapped_type::which() of the value
+		payload_type payload; // binary representation of the value, unless it is stored as a table
+		boost::interprocess::offset_ptr<table> child; // sub-dictionary or std::vector<dict>, or null
+		// When the key was added to the top level table. Stamps increase along the sequence in every version, so
+		// iterators find their way back to the next value after the current one was erased. Not part of the key.
+		mutable size_type order;
+	};
+
+	// Hashes and compares keys stored in shared memory and std::string keys alike.
+	struct key_hash
+	{
+		template<class String>
+		std::size_t operator()(const String& key) const
+		{
+			return boost::hash_range(key.begin(), key.end());
+		}
+	};
+
+	struct key_equal
+	{
+		template<class Lhs, class Rhs>
+		bool operator()(const Lhs& lhs, const Rhs& rhs) const
+		{
+			return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+		}
+	};
+
+	typedef boost::multi_index_container<
+		entry
+		, boost::multi_index::indexed_by<
+			boost::multi_index::sequenced<>
+			, boost::multi_index::hashed_unique<boost::multi_index::member<entry, string_type, &entry::key>, key_hash, key_equal>
+		>
+		, boost::interprocess::allocator<entry, segment_manager>
+	> table_base;
+
+	// Tables are never modified once readers can reach them, so that they can be shared between versions.
+	struct table : table_base
+	{
+		table(const allocator_type& allocator, const bool elements)
+		: table_base(allocator)
+		, refs(1)
+		, elements(elements)
+		{
+
+		}
+
+		size_type refs; // number of roots and entries sharing this table, only changed by writers
+		const bool elements; // holds the dictionaries of a std::vector<dict>, keyed by their index
+	};
+
+	typedef table::nth_index<1>::type key_index_type;
+
+	static const std::size_t max_readers = 128; // reads in progress at once, across all processes
+	static const boost::uint32_t reclaiming = ~boost::uint32_t(0); // owner of a slot being freed
+
+	// A read in progress announces the version it started from, so that writers don't free tables it may use.
+	// boost::ipc_atomic is Boost.Atomic's atomic for memory shared between processes: it only compiles for
+	// lock-free types, which need no process-local state.
+	struct reader_slot
+	{
+		reader_slot()
+		: pid(0)
+		, epoch(0)
+		{
+
+		}
+
+		boost::ipc_atomic<boost::uint32_t> pid; // process owning this slot, or 0
+		boost::ipc_atomic<size_type> epoch; // version being read plus one, or 0
+	};
+
+	// Lives at a well-known name in the segment.
+	struct header
+	{
+		header()
+		: root(0)
+		, version(0)
+		, stamps(0)
+		{
+
+		}
+
+		mutex_type writer; // serializes writers
+		boost::ipc_atomic<handle_type> root; // handle of the top level table, or 0 while empty
+		boost::ipc_atomic<size_type> version;
+		size_type stamps; // insertion stamps handed out to top level entries, guarded by writer
+		reader_slot readers[max_readers];
+	};
+
+	// Pins the tables reachable from the root while alive. Never waits for writers.
+	class read_section
+	{
+	public:
+		explicit read_section(const shared_dict& owner)
+		: slot(owner.claim())
+		, version(owner.head->version.load())
+		{
+			// a writer either sees the announced version, or the read sees the writer's newer version
+			for(;;)
+			{
+				slot->epoch.store(version + 1);
+				const size_type latest = owner.head->version.load();
+				if(latest == version)
+					break;
+				version = latest;
+			}
+			root = owner.root();
+		}
+
+		~read_section()
+		{
+			slot->epoch.store(0);
+			slot->pid.store(0);
+		}
+
+	private:
+		read_section(const read_section&);
+		read_section& operator=(const read_section&);
+
+		reader_slot* slot;
+
+	public:
+		size_type version;
+		const table* root;
+	};
+
+public:
+	//! Opens the named shared memory segment, creating it with the given size in bytes if it doesn't exist.
+	//! Throws boost::interprocess::interprocess_exception if the segment can not be opened or created.
+	shared_dict(boost::interprocess::open_or_create_t, const char* name, const std::size_t size)
+	: segment(boost::interprocess::open_or_create, name, size)
+	, head(segment.find_or_construct<header>("dict")())
+	{
+
+	}
+
+	//! Opens an existing named shared memory segment.
+	//! Throws boost::interprocess::interprocess_exception if the segment does not exist.
+	shared_dict(boost::interprocess::open_only_t, const char* name)
+	: segment(boost::interprocess::open_only, name)
+	, head(segment.find_or_construct<header>("dict")())
+	{
+
+	}
+
+	//! Removes the named shared memory segment. Processes that have it open may keep using it.
+	//! Returns true on success, false otherwise.
+	static bool remove(const char* name)
+	{
+		return boost::interprocess::shared_memory_object::remove(name);
+	}
+
+	//! Replaces the contents of this dictionary with a copy of the given dictionary.
+	//! The copy is built before taking the writer mutex, and readers see either all of it or none of it.
+	//! Returns true on success; if the segment runs out of memory, this dictionary is left unchanged.
+	bool publish(const dict& d);
+
+	//! Adds (or replaces if already existent) the given (key, value) pair to this dictionary.
+	//! Value may be implicitly converted to a supported type, as with dict::add().
+	//! The top level table is copied, sharing its sub-dictionaries, so publish() suits batches of changes better.
+	//! Returns true on success; if the segment runs out of memory, this dictionary is left unchanged.
+	template<class T>
+	bool add(const key_type& key, const T& value)
+	{
+		dict converted;
+		converted.add(key, value);
+		return put(converted.front());
+	}
+
+	//! Erases the value matching the given key from this dictionary, copying the top level table as add() does.
+	//! Returns 1 if a value was erased, 0 if there was none or if the segment ran out of memory.
+	size_type erase(const key_type& key);
+
+	//! Clears all items from this dictionary.
+	void clear()
+	{
+		const write_lock lock(head->writer);
+		swap_root(0);
+	}
+
+	//! Gets the value associated with the given key out of this dictionary, as dict::get() does.
+	//! Returns true on success, false otherwise.
+	template<class T>
+	bool get(const key_type& key, T& value) const;
+
+	//! Gets a dict value at the associated key if possible, otherwise returns an empty dict.
+	dict get(const key_type& key) const
+	{
+		dict rvalue;
+		get(key, rvalue);
+		return rvalue;
+	}
+
+	//! Same as get() but additionally supports recursively descending into sub-dictionaries by delimiting sub-keys with "::".
+	//! Dictionaries inside a std::vector<dict> are addressed by their index, as in "users::0::name", in constant time.
+	template<class T>
+	bool get_recursive(const key_type& key, T& value) const;
+
+	//! Returns 1 if key exists in this dictionary, otherwise 0.
+	size_type count(const key_type& key) const
+	{
+		const read_section section(*this);
+		return section.root ? section.root->get<1>().count(key, key_hash(), key_equal()) : 0;
+	}
+
+	//! Returns the number of items in this dictionary.
+	size_type size() const
+	{
+		const read_section section(*this);
+		return section.root ? section.root->size() : 0;
+	}
+
+	//! True iff there are no values in this dictionary.
+	bool empty() const
+	{
+		return !size();
+	}
+
+	//! Returns the number of changes made to this dictionary since its segment was created.
+	size_type version() const
+	{
+		return head->version.load();
+	}
+
+	//! Returns a copy of this dictionary in local memory.
+	dict snapshot() const
+	{
+		const read_section section(*this);
+		return section.root ? to_dict(*section.root) : dict();
+	}
+
+	//! Returns a std::string representation of this dictionary.
+	std::string str() const
+	{
+		return snapshot().str();
+	}
+
+	//! Returns a sequential iterator to the beginning of the sequence.
+	//! Iterators copy the current value and pin nothing in between steps, so the loop body may read or write freely.
+	//! If the dictionary changes meanwhile, iteration continues with the values that follow the current one in the new
+	//! version, even if the current one was erased: values erased meanwhile are skipped, and values added, which go
+	//! at the end, are visited. publish() counts as erasing every value and adding the new ones.
+	const_iterator begin() const;
+
+	//! Returns a sequential iterator to one past the end of the sequence.
+	const_iterator end() const;
+
+private:
+	shared_dict(const shared_dict&);
+	shared_dict& operator=(const shared_dict&);
+
+	const table* root() const
+	{
+		const handle_type handle = head->root.load();
+		return handle ? static_cast<const table*>(segment.get_address_from_handle(handle)) : 0;
+	}
+
+	// Takes a free reader slot for this process, first freeing the slots of exited processes if there is none.
+	reader_slot* claim() const
+	{
+		const boost::uint32_t self = details::current_process();
+		for(;;)
+		{
+			for(reader_slot* slot = head->readers, *end = slot + max_readers; slot != end; ++slot)
+			{
+				boost::uint32_t expected = 0;
+				if(slot->pid.load() == 0 && slot->pid.compare_exchange_strong(expected, self))
+					return slot;
+			}
+			for(reader_slot* slot = head->readers, *end = slot + max_readers; slot != end; ++slot)
+				reclaim(*slot);
+			details::yield_thread();
+		}
+	}
+
+	// Frees the slot if its process has exited. Returns true if the slot is free.
+	static bool reclaim(reader_slot& slot)
+	{
+		boost::uint32_t pid = slot.pid.load();
+		if(pid == 0)
+			return true;
+		if(pid == reclaiming || details::process_alive(pid) || !slot.pid.compare_exchange_strong(pid, reclaiming))
+			return false;
+		slot.epoch.store(0);
+		slot.pid.store(0);
+		return true;
+	}
+
+	// Makes the given table the root, then releases the old root once no reader can be using it.
+	// The caller holds head->writer.
+	void swap_root(table* t)
+	{
+		table* old = const_cast<table*>(root());
+		head->root.store(t ? segment.get_handle_from_address(t) : 0);
+		const size_type previous = head->version.fetch_add(1);
+		for(reader_slot* slot = head->readers, *end = slot + max_readers; slot != end; ++slot)
+			for(size_type epoch; (epoch = slot->epoch.load()) != 0 && epoch <= previous + 1 && !reclaim(*slot); )
+				details::yield_thread();
+		release(old);
+	}
+
+	// Converts a stored value back into a dict value.
+	mapped_type value(const entry& e) const
+	{
+		if(e.child && e.child->elements)
+		{
+			std::vector<dict> rvalue;
+			rvalue.reserve(e.child->size());
+			for(table::const_iterator i = e.child->begin(), end = e.child->end(); i != end; ++i)
+				rvalue.push_back(to_dict(*i->child));
+			return rvalue;
+		}
+		if(e.child)
+			return to_dict(*e.child);
+		mapped_type rvalue;
+		details::memory_buffer buffer(e.payload.empty() ? 0 : &e.payload[0], e.payload.size());
+		std::istream in(&buffer);
+		dict::binary_io::alternative_reader<boost::mpl::begin<dict::types>::type>::read(in, e.which, rvalue, 0);
+		return rvalue;
+	}
+
+	dict to_dict(const table& t) const
+	{
+		std::vector<value_type> values;
+		values.reserve(t.size());
+		for(table::const_iterator i = t.begin(), end = t.end(); i != end; ++i)
+			values.push_back(value_type(key_type(i->key.begin(), i->key.end()), value(*i)));
+		return dict(values.begin(), values.end());
+	}
+
+	table* new_table(const bool elements)
+	{
+		return segment.construct<table>(boost::interprocess::anonymous_instance)(segment.get_segment_manager(), elements);
+	}
+
+	// Appends an entry to a table under construction, releasing the entry's table if that fails.
+	void append(table& t, const entry& e)
+	{
+		try
+		{
+			t.push_back(e);
+		}
+		catch(...)
+		{
+			release(e.child.get());
+			throw;
+		}
+	}
+
+	// Builds a copy of the given dictionary in the segment. Throws boost::interprocess::bad_alloc if it is full.
+	table* build(const dict& d)
+	{
+		table* t = new_table(false);
+		try
+		{
+			for(dict::const_iterator i = d.begin(), end = d.end(); i != end; ++i)
+			{
+				entry e(i->first, segment.get_segment_manager());
+				encode(*i, e);
+				append(*t, e);
+			}
+		}
+		catch(...)
+		{
+			release(t);
+			throw;
+		}
+		return t;
+	}
+
+	// Same as above, for the dictionaries of a vector.
+	table* build(const std::vector<dict>& v)
+	{
+		const int which = mapped_type(dict()).which();
+		table* t = new_table(true);
+		try
+		{
+			for(std::size_t index = 0; index < v.size(); ++index)
+			{
+				entry e(boost::lexical_cast<key_type>(index), segment.get_segment_manager());
+				e.which = which;
+				e.child = build(v[index]);
+				append(*t, e);
+			}
+		}
+		catch(...)
+		{
+			release(t);
+			throw;
+		}
+		return t;
+	}
+
+	// Copies the given table, except for the value at skip if any, sharing its sub-tables.
+	table* copy(const table* source, const key_type* skip)
+	{
+		table* t = new_table(false);
+		if(!source)
+			return t;
+		try
+		{
+			for(table::const_iterator i = source->begin(), end = source->end(); i != end; ++i)
+			{
+				if(skip && key_equal()(i->key, *skip))
+					continue;
+				t->push_back(*i);
+				if(i->child)
+					++i->child->refs;
+			}
+		}
+		catch(...)
+		{
+			release(t);
+			throw;
+		}
+		return t;
+	}
+
+	void encode(const value_type& value, entry& e)
+	{
+		e.which = value.second.which();
+		if(const dict* sub = boost::get<dict>(&value.second))
+		{
+			e.child = build(*sub);
+			return;
+		}
+		if(const std::vector<dict>* v = boost::get<std::vector<dict> >(&value.second))
+		{
+			e.child = build(*v);
+			return;
+		}
+		std::ostringstream out;
+		const dict::binary_io::save_visitor visitor(out);
+		boost::apply_visitor(visitor, value.second);
+		const std::string bytes = out.str();
+		e.payload.assign(bytes.begin(), bytes.end());
+	}
+
+	// Drops a reference to a table, destroying it and releasing its sub-tables once it was the last one.
+	void release(table* t)
+	{
+		if(!t || --t->refs)
+			return;
+		for(table::iterator i = t->begin(), end = t->end(); i != end; ++i)
+			release(i->child.get());
+		segment.destroy_ptr(t);
+	}
+
+	bool put(const value_type& value);
+
+	mutable segment_type segment;
+	header* head;
+};
+
+class shared_dict::const_iterator
+: public boost::iterator_facade<const_iterator, const value_type, boost::forward_traversal_tag>
+{
+public:
+	//! Creates an end iterator.
+	const_iterator()
+	: owner(0)
+	{
+
+	}
+
+private:
+	friend class shared_dict;
+	friend class boost::iterator_core_access;
+
+	explicit const_iterator(const shared_dict& owner)
+	: owner(&owner)
+	{
+		const read_section section(owner);
+		version = section.version;
+		if(!section.root || section.root->empty())
+		{
+			this->owner = 0;
+			return;
+		}
+		position = section.root->begin();
+		load();
+	}
+
+	const value_type& dereference() const
+	{
+		return current;
+	}
+
+	bool equal(const const_iterator& other) const
+	{
+		if(!owner || !other.owner)
+			return !owner && !other.owner;
+		return version == other.version && position == other.position;
+	}
+
+	void increment()
+	{
+		const read_section section(*owner);
+		if(section.version != version)
+		{
+			// the table position points into may be gone, so find the current value in the new version
+			version = section.version;
+			if(!section.root)
+			{
+				owner = 0;
+				return;
+			}
+			const key_index_type& index = section.root->get<1>();
+			const key_index_type::const_iterator i = index.find(current.first, key_hash(), key_equal());
+			if(i != index.end() && i->order == order)
+			{
+				position = section.root->project<0>(i);
+				++position;
+			}
+			else
+			{
+				// erased, or erased and added again at the end: resume with the first value added after it
+				for(position = section.root->begin(); position != section.root->end() && position->order <= order; ++position)
+					;
+			}
+		}
+		else
+		{
+			++position;
+		}
+		if(position == section.root->end())
+		{
+			owner = 0;
+			return;
+		}
+		load();
+	}
+
+	// Copies the value at position. The caller holds a read section.
+	void load()
+	{
+		current = value_type(key_type(position->key.begin(), position->key.end()), owner->value(*position));
+		order = position->order;
+	}
+
+	const shared_dict* owner; // null at the end
+	size_type version; // version that position points into
+	table::const_iterator position;
+	value_type current;
+	size_type order; // insertion stamp of the current value
+};
+
+inline bool shared_dict::publish(const dict& d)
+{
+	table* t = 0;
+	try
+	{
+		t = build(d);
+	}
+	catch(const boost::interprocess::bad_alloc&)
+	{
+		return false;
+	}
+	const write_lock lock(head->writer);
+	// a new version replaces every value, so its values come after any an iterator may be at
+	for(table::iterator i = t->begin(), end = t->end(); i != end; ++i)
+		i->order = ++head->stamps;
+	swap_root(t);
+	return true;
+}
+
+inline bool shared_dict::put(const value_type& value)
+{
+	try
+	{
+		entry e(value.first, segment.get_segment_manager());
+		encode(value, e);
+
+		const write_lock lock(head->writer);
+		table* t = 0;
+		try
+		{
+			t = copy(root(), 0);
+			key_index_type& index = t->get<1>();
+			const key_index_type::iterator i = index.find(value.first, key_hash(), key_equal());
+			if(i == index.end())
+			{
+				e.order = ++head->stamps;
+				t->push_back(e);
+			}
+			else
+			{
+				table* replaced = i->child.get();
+				e.order = i->order; // keeps its place
+				index.replace(i, e);
+				release(replaced); // still shared with the current root
+			}
+		}
+		catch(...)
+		{
+			release(t);
+			release(e.child.get());
+			throw;
+		}
+		swap_root(t);
+		return true;
+	}
+	catch(const boost::interprocess::bad_alloc&)
+	{
+		return false;
+	}
+}
+
+inline shared_dict::size_type shared_dict::erase(const key_type& key)
+{
+	const write_lock lock(head->writer);
+	const table* current = root();
+	if(!current || !current->get<1>().count(key, key_hash(), key_equal()))
+		return 0;
+	try
+	{
+		swap_root(copy(current, &key));
+	}
+	catch(const boost::interprocess::bad_alloc&)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+template<class T>
+inline bool shared_dict::get(const key_type& key, T& value) const
+{
+	const read_section section(*this);
+	if(!section.root)
+		return false;
+	const key_index_type& index = section.root->get<1>();
+	const key_index_type::const_iterator i = index.find(key, key_hash(), key_equal());
+	if(i == index.end())
+		return false;
+	const mapped_type stored = this->value(*i);
+	return boost::apply_visitor(details::get_visitor<T>(value), stored);
+}
+
+template<class T>
+inline bool shared_dict::get_recursive(const key_type& key, T& value) const
+{
+	std::vector<key_type> keys;
+	details::split_path(key, keys);
+
+	const read_section section(*this);
+	const table* t = section.root;
+	for(std::vector<key_type>::size_type n = 0; t; ++n)
+	{
+		key_type sub = keys[n];
+		if(t->elements)
+		{
+			// the dictionaries of a vector are keyed by their index in canonical form
+			std::size_t position;
+			if(!details::parse_index(sub, position))
+				return false;
+			sub = boost::lexical_cast<key_type>(position);
+		}
+
+		const key_index_type& lookup = t->get<1>();
+		const key_index_type::const_iterator i = lookup.find(sub, key_hash(), key_equal());
+		if(i == lookup.end())
+			return false;
+		if(n + 1 == keys.size())
+		{
+			const mapped_type stored = this->value(*i);
+			return boost::apply_visitor(details::get_visitor<T>(value), stored);
+		}
+		t = i->child.get();
+	}
+	return false;
+}
+
+inline shared_dict::const_iterator shared_dict::begin() const
+{
+	return const_iterator(*this);
+}
+
+inline shared_dict::const_iterator shared_dict::end() const
+{
+	return const_iterator();
+}
+
+#endif // LEXICALUNIT_SHARED_DICT_H